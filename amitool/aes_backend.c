@@ -0,0 +1,542 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "nfc3d/aes_backend.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define NFC3D_AES_HAVE_AESNI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__GNUC__)
+#define NFC3D_AES_HAVE_ARMV8 1
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#if !defined(MBEDTLS_AES_ENCRYPT_ALT)
+#error "aes_backend.c provides mbedtls_aes_encrypt and needs MBEDTLS_AES_ENCRYPT_ALT"
+#endif
+
+#define NFC3D_AES_MAX_ROUNDS 14
+
+/* Keystream is produced this many blocks at a time */
+#define NFC3D_AES_CHUNK_BLOCKS 32
+
+/*
+ * Encrypts blocks (ECB) for count independent streams, each with its own key.
+ * Input and output may alias.
+ */
+typedef void (*nfc3d_aes_blocks_fn)(const mbedtls_aes_context * const * aes, const uint8_t * const * input, uint8_t * const * output, size_t blocks, size_t count);
+
+static void nfc3d_aes_blocks_c(const mbedtls_aes_context * const * aes, const uint8_t * const * input, uint8_t * const * output, size_t blocks, size_t count) {
+	size_t stream, block;
+
+	for (stream = 0; stream < count; stream++) {
+		for (block = 0; block < blocks; block++) {
+			mbedtls_aes_encrypt_c((mbedtls_aes_context *) aes[stream], input[stream] + block * NFC3D_AES_BLOCK_SIZE, output[stream] + block * NFC3D_AES_BLOCK_SIZE);
+		}
+	}
+}
+
+/*
+ * ARM11 backend. The MPCore has no AES instructions, so this is the T-table
+ * cipher cut down to a single 1 KB table: the other three are byte rotations
+ * of it, which the barrel shifter folds into the EOR for free, and the S-box
+ * for the last round is byte 1 of every entry. The working set stays a
+ * quarter of what the four mbedtls tables plus S-box occupy in the 16 KB
+ * data cache.
+ */
+static const uint32_t nfc3d_aes_ft[256] = {
+	0xA56363C6, 0x847C7CF8, 0x997777EE, 0x8D7B7BF6, 0x0DF2F2FF, 0xBD6B6BD6, 0xB16F6FDE, 0x54C5C591,
+	0x50303060, 0x03010102, 0xA96767CE, 0x7D2B2B56, 0x19FEFEE7, 0x62D7D7B5, 0xE6ABAB4D, 0x9A7676EC,
+	0x45CACA8F, 0x9D82821F, 0x40C9C989, 0x877D7DFA, 0x15FAFAEF, 0xEB5959B2, 0xC947478E, 0x0BF0F0FB,
+	0xECADAD41, 0x67D4D4B3, 0xFDA2A25F, 0xEAAFAF45, 0xBF9C9C23, 0xF7A4A453, 0x967272E4, 0x5BC0C09B,
+	0xC2B7B775, 0x1CFDFDE1, 0xAE93933D, 0x6A26264C, 0x5A36366C, 0x413F3F7E, 0x02F7F7F5, 0x4FCCCC83,
+	0x5C343468, 0xF4A5A551, 0x34E5E5D1, 0x08F1F1F9, 0x937171E2, 0x73D8D8AB, 0x53313162, 0x3F15152A,
+	0x0C040408, 0x52C7C795, 0x65232346, 0x5EC3C39D, 0x28181830, 0xA1969637, 0x0F05050A, 0xB59A9A2F,
+	0x0907070E, 0x36121224, 0x9B80801B, 0x3DE2E2DF, 0x26EBEBCD, 0x6927274E, 0xCDB2B27F, 0x9F7575EA,
+	0x1B090912, 0x9E83831D, 0x742C2C58, 0x2E1A1A34, 0x2D1B1B36, 0xB26E6EDC, 0xEE5A5AB4, 0xFBA0A05B,
+	0xF65252A4, 0x4D3B3B76, 0x61D6D6B7, 0xCEB3B37D, 0x7B292952, 0x3EE3E3DD, 0x712F2F5E, 0x97848413,
+	0xF55353A6, 0x68D1D1B9, 0x00000000, 0x2CEDEDC1, 0x60202040, 0x1FFCFCE3, 0xC8B1B179, 0xED5B5BB6,
+	0xBE6A6AD4, 0x46CBCB8D, 0xD9BEBE67, 0x4B393972, 0xDE4A4A94, 0xD44C4C98, 0xE85858B0, 0x4ACFCF85,
+	0x6BD0D0BB, 0x2AEFEFC5, 0xE5AAAA4F, 0x16FBFBED, 0xC5434386, 0xD74D4D9A, 0x55333366, 0x94858511,
+	0xCF45458A, 0x10F9F9E9, 0x06020204, 0x817F7FFE, 0xF05050A0, 0x443C3C78, 0xBA9F9F25, 0xE3A8A84B,
+	0xF35151A2, 0xFEA3A35D, 0xC0404080, 0x8A8F8F05, 0xAD92923F, 0xBC9D9D21, 0x48383870, 0x04F5F5F1,
+	0xDFBCBC63, 0xC1B6B677, 0x75DADAAF, 0x63212142, 0x30101020, 0x1AFFFFE5, 0x0EF3F3FD, 0x6DD2D2BF,
+	0x4CCDCD81, 0x140C0C18, 0x35131326, 0x2FECECC3, 0xE15F5FBE, 0xA2979735, 0xCC444488, 0x3917172E,
+	0x57C4C493, 0xF2A7A755, 0x827E7EFC, 0x473D3D7A, 0xAC6464C8, 0xE75D5DBA, 0x2B191932, 0x957373E6,
+	0xA06060C0, 0x98818119, 0xD14F4F9E, 0x7FDCDCA3, 0x66222244, 0x7E2A2A54, 0xAB90903B, 0x8388880B,
+	0xCA46468C, 0x29EEEEC7, 0xD3B8B86B, 0x3C141428, 0x79DEDEA7, 0xE25E5EBC, 0x1D0B0B16, 0x76DBDBAD,
+	0x3BE0E0DB, 0x56323264, 0x4E3A3A74, 0x1E0A0A14, 0xDB494992, 0x0A06060C, 0x6C242448, 0xE45C5CB8,
+	0x5DC2C29F, 0x6ED3D3BD, 0xEFACAC43, 0xA66262C4, 0xA8919139, 0xA4959531, 0x37E4E4D3, 0x8B7979F2,
+	0x32E7E7D5, 0x43C8C88B, 0x5937376E, 0xB76D6DDA, 0x8C8D8D01, 0x64D5D5B1, 0xD24E4E9C, 0xE0A9A949,
+	0xB46C6CD8, 0xFA5656AC, 0x07F4F4F3, 0x25EAEACF, 0xAF6565CA, 0x8E7A7AF4, 0xE9AEAE47, 0x18080810,
+	0xD5BABA6F, 0x887878F0, 0x6F25254A, 0x722E2E5C, 0x241C1C38, 0xF1A6A657, 0xC7B4B473, 0x51C6C697,
+	0x23E8E8CB, 0x7CDDDDA1, 0x9C7474E8, 0x211F1F3E, 0xDD4B4B96, 0xDCBDBD61, 0x868B8B0D, 0x858A8A0F,
+	0x907070E0, 0x423E3E7C, 0xC4B5B571, 0xAA6666CC, 0xD8484890, 0x05030306, 0x01F6F6F7, 0x120E0E1C,
+	0xA36161C2, 0x5F35356A, 0xF95757AE, 0xD0B9B969, 0x91868617, 0x58C1C199, 0x271D1D3A, 0xB99E9E27,
+	0x38E1E1D9, 0x13F8F8EB, 0xB398982B, 0x33111122, 0xBB6969D2, 0x70D9D9A9, 0x898E8E07, 0xA7949433,
+	0xB69B9B2D, 0x221E1E3C, 0x92878715, 0x20E9E9C9, 0x49CECE87, 0xFF5555AA, 0x78282850, 0x7ADFDFA5,
+	0x8F8C8C03, 0xF8A1A159, 0x80898909, 0x170D0D1A, 0xDABFBF65, 0x31E6E6D7, 0xC6424284, 0xB86868D0,
+	0xC3414182, 0xB0999929, 0x772D2D5A, 0x110F0F1E, 0xCBB0B07B, 0xFC5454A8, 0xD6BBBB6D, 0x3A16162C,
+};
+
+#define ARMV6_ROTL(x,n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define ARMV6_T0(x) (nfc3d_aes_ft[(x) & 0xFF])
+#define ARMV6_T1(x) ARMV6_ROTL(nfc3d_aes_ft[((x) >> 8) & 0xFF], 8)
+#define ARMV6_T2(x) ARMV6_ROTL(nfc3d_aes_ft[((x) >> 16) & 0xFF], 16)
+#define ARMV6_T3(x) ARMV6_ROTL(nfc3d_aes_ft[(x) >> 24], 24)
+
+#define ARMV6_SB(x) ((nfc3d_aes_ft[x] >> 8) & 0xFF)
+
+#define ARMV6_ROUND(X0,X1,X2,X3,Y0,Y1,Y2,Y3) \
+	do { \
+		X0 = RK[0] ^ ARMV6_T0(Y0) ^ ARMV6_T1(Y1) ^ ARMV6_T2(Y2) ^ ARMV6_T3(Y3); \
+		X1 = RK[1] ^ ARMV6_T0(Y1) ^ ARMV6_T1(Y2) ^ ARMV6_T2(Y3) ^ ARMV6_T3(Y0); \
+		X2 = RK[2] ^ ARMV6_T0(Y2) ^ ARMV6_T1(Y3) ^ ARMV6_T2(Y0) ^ ARMV6_T3(Y1); \
+		X3 = RK[3] ^ ARMV6_T0(Y3) ^ ARMV6_T1(Y0) ^ ARMV6_T2(Y1) ^ ARMV6_T3(Y2); \
+		RK += 4; \
+	} while (0)
+
+#define ARMV6_LAST(Y0,Y1,Y2,Y3) \
+	(ARMV6_SB((Y0) & 0xFF) ^ (ARMV6_SB(((Y1) >> 8) & 0xFF) << 8) ^ \
+	(ARMV6_SB(((Y2) >> 16) & 0xFF) << 16) ^ (ARMV6_SB((Y3) >> 24) << 24))
+
+static inline uint32_t nfc3d_aes_load_le32(const uint8_t * p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+static inline void nfc3d_aes_store_le32(uint8_t * p, uint32_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	memcpy(p, &v, sizeof(v));
+}
+
+static void nfc3d_aes_encrypt_armv6(const mbedtls_aes_context * ctx, const uint8_t * input, uint8_t * output) {
+	const uint32_t * RK = ctx->rk;
+	uint32_t X0, X1, X2, X3, Y0, Y1, Y2, Y3;
+	int i;
+
+	// Unaligned LDR is fine on ARMv6, memcpy compiles down to it
+	X0 = nfc3d_aes_load_le32(input + 0) ^ RK[0];
+	X1 = nfc3d_aes_load_le32(input + 4) ^ RK[1];
+	X2 = nfc3d_aes_load_le32(input + 8) ^ RK[2];
+	X3 = nfc3d_aes_load_le32(input + 12) ^ RK[3];
+	RK += 4;
+
+	for (i = (ctx->nr >> 1) - 1; i > 0; i--) {
+		ARMV6_ROUND(Y0, Y1, Y2, Y3, X0, X1, X2, X3);
+		ARMV6_ROUND(X0, X1, X2, X3, Y0, Y1, Y2, Y3);
+	}
+	ARMV6_ROUND(Y0, Y1, Y2, Y3, X0, X1, X2, X3);
+
+	nfc3d_aes_store_le32(output + 0, RK[0] ^ ARMV6_LAST(Y0, Y1, Y2, Y3));
+	nfc3d_aes_store_le32(output + 4, RK[1] ^ ARMV6_LAST(Y1, Y2, Y3, Y0));
+	nfc3d_aes_store_le32(output + 8, RK[2] ^ ARMV6_LAST(Y2, Y3, Y0, Y1));
+	nfc3d_aes_store_le32(output + 12, RK[3] ^ ARMV6_LAST(Y3, Y0, Y1, Y2));
+}
+
+static void nfc3d_aes_blocks_armv6(const mbedtls_aes_context * const * aes, const uint8_t * const * input, uint8_t * const * output, size_t blocks, size_t count) {
+	size_t stream, block;
+
+	for (stream = 0; stream < count; stream++) {
+		for (block = 0; block < blocks; block++) {
+			nfc3d_aes_encrypt_armv6(aes[stream], input[stream] + block * NFC3D_AES_BLOCK_SIZE, output[stream] + block * NFC3D_AES_BLOCK_SIZE);
+		}
+	}
+}
+
+#if NFC3D_AES_HAVE_AESNI
+/*
+ * Streams are interleaved two blocks at a time, so up to eight independent
+ * AESENC chains are in flight to cover the instruction latency.
+ */
+__attribute__((target("aes,sse2")))
+static void nfc3d_aes_blocks_aesni(const mbedtls_aes_context * const * aes, const uint8_t * const * input, uint8_t * const * output, size_t blocks, size_t count) {
+	__m128i rk[NFC3D_AES_MAX_STREAMS][NFC3D_AES_MAX_ROUNDS + 1];
+	__m128i x[NFC3D_AES_MAX_STREAMS][2];
+	size_t stream, block, pos, group;
+	int round, nr;
+
+	assert(count <= NFC3D_AES_MAX_STREAMS);
+
+	nr = aes[0]->nr;
+	for (stream = 0; stream < count; stream++) {
+		assert(aes[stream]->nr == nr);
+		for (round = 0; round <= nr; round++) {
+			rk[stream][round] = _mm_loadu_si128((const __m128i *) (aes[stream]->rk + 4 * round));
+		}
+	}
+
+	for (pos = 0; pos < blocks; pos += group) {
+		group = blocks - pos < 2 ? blocks - pos : 2;
+
+		for (stream = 0; stream < count; stream++) {
+			for (block = 0; block < group; block++) {
+				x[stream][block] = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (input[stream] + (pos + block) * NFC3D_AES_BLOCK_SIZE)), rk[stream][0]);
+			}
+		}
+
+		for (round = 1; round < nr; round++) {
+			for (stream = 0; stream < count; stream++) {
+				for (block = 0; block < group; block++) {
+					x[stream][block] = _mm_aesenc_si128(x[stream][block], rk[stream][round]);
+				}
+			}
+		}
+
+		for (stream = 0; stream < count; stream++) {
+			for (block = 0; block < group; block++) {
+				_mm_storeu_si128((__m128i *) (output[stream] + (pos + block) * NFC3D_AES_BLOCK_SIZE), _mm_aesenclast_si128(x[stream][block], rk[stream][nr]));
+			}
+		}
+	}
+}
+
+static bool nfc3d_aes_cpu_has_aesni(void) {
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+	return (ecx & bit_AES) != 0 && (edx & bit_SSE2) != 0;
+}
+#endif
+
+#if NFC3D_AES_HAVE_ARMV8
+__attribute__((target("+crypto")))
+static void nfc3d_aes_blocks_armv8(const mbedtls_aes_context * const * aes, const uint8_t * const * input, uint8_t * const * output, size_t blocks, size_t count) {
+	uint8x16_t rk[NFC3D_AES_MAX_STREAMS][NFC3D_AES_MAX_ROUNDS + 1];
+	uint8x16_t x[NFC3D_AES_MAX_STREAMS][2];
+	size_t stream, block, pos, group;
+	int round, nr;
+
+	assert(count <= NFC3D_AES_MAX_STREAMS);
+
+	nr = aes[0]->nr;
+	for (stream = 0; stream < count; stream++) {
+		assert(aes[stream]->nr == nr);
+		for (round = 0; round <= nr; round++) {
+			rk[stream][round] = vld1q_u8((const uint8_t *) (aes[stream]->rk + 4 * round));
+		}
+	}
+
+	for (pos = 0; pos < blocks; pos += group) {
+		group = blocks - pos < 2 ? blocks - pos : 2;
+
+		for (stream = 0; stream < count; stream++) {
+			for (block = 0; block < group; block++) {
+				x[stream][block] = vld1q_u8(input[stream] + (pos + block) * NFC3D_AES_BLOCK_SIZE);
+			}
+		}
+
+		// AESE does AddRoundKey+SubBytes+ShiftRows, AESMC the MixColumns
+		for (round = 0; round < nr - 1; round++) {
+			for (stream = 0; stream < count; stream++) {
+				for (block = 0; block < group; block++) {
+					x[stream][block] = vaesmcq_u8(vaeseq_u8(x[stream][block], rk[stream][round]));
+				}
+			}
+		}
+
+		for (stream = 0; stream < count; stream++) {
+			for (block = 0; block < group; block++) {
+				x[stream][block] = veorq_u8(vaeseq_u8(x[stream][block], rk[stream][nr - 1]), rk[stream][nr]);
+				vst1q_u8(output[stream] + (pos + block) * NFC3D_AES_BLOCK_SIZE, x[stream][block]);
+			}
+		}
+	}
+}
+
+static bool nfc3d_aes_cpu_has_armv8(void) {
+#if defined(__linux__) && defined(HWCAP_AES)
+	return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#elif defined(__ARM_FEATURE_AES) || defined(__ARM_FEATURE_CRYPTO)
+	return true;
+#else
+	return false;
+#endif
+}
+#endif
+
+static const nfc3d_aes_blocks_fn nfc3d_aes_backends[NFC3D_AES_BACKEND_COUNT] = {
+	[NFC3D_AES_BACKEND_C] = nfc3d_aes_blocks_c,
+	[NFC3D_AES_BACKEND_ARMV6] = nfc3d_aes_blocks_armv6,
+#if NFC3D_AES_HAVE_AESNI
+	[NFC3D_AES_BACKEND_AESNI] = nfc3d_aes_blocks_aesni,
+#endif
+#if NFC3D_AES_HAVE_ARMV8
+	[NFC3D_AES_BACKEND_ARMV8] = nfc3d_aes_blocks_armv8,
+#endif
+};
+
+static const char * const nfc3d_aes_backend_names[NFC3D_AES_BACKEND_COUNT] = {
+	[NFC3D_AES_BACKEND_C] = "c",
+	[NFC3D_AES_BACKEND_ARMV6] = "armv6",
+	[NFC3D_AES_BACKEND_AESNI] = "aes-ni",
+	[NFC3D_AES_BACKEND_ARMV8] = "armv8-ce",
+};
+
+static void nfc3d_aes_blocks_resolve(const mbedtls_aes_context * const * aes, const uint8_t * const * input, uint8_t * const * output, size_t blocks, size_t count);
+
+/*
+ * Resolved on first use by whichever threads get there, like the SHA-256
+ * backend. Every resolver picks the same backend, so atomic stores are all
+ * it takes; ciphering loads the pointer relaxed.
+ */
+static nfc3d_aes_blocks_fn nfc3d_aes_blocks_impl = nfc3d_aes_blocks_resolve;
+static nfc3d_aes_backend nfc3d_aes_current = NFC3D_AES_BACKEND_C;
+
+static inline nfc3d_aes_blocks_fn nfc3d_aes_blocks(void) {
+	return __atomic_load_n(&nfc3d_aes_blocks_impl, __ATOMIC_RELAXED);
+}
+
+void mbedtls_aes_encrypt(mbedtls_aes_context * ctx, const unsigned char input[16], unsigned char output[16]) {
+	const mbedtls_aes_context * aes = ctx;
+	nfc3d_aes_blocks()(&aes, &input, &output, 1, 1);
+}
+
+const char * nfc3d_aes_backend_name(nfc3d_aes_backend backend) {
+	if ((unsigned int) backend >= NFC3D_AES_BACKEND_COUNT)
+		return "unknown";
+	return nfc3d_aes_backend_names[backend];
+}
+
+bool nfc3d_aes_backend_available(nfc3d_aes_backend backend) {
+	switch (backend) {
+		case NFC3D_AES_BACKEND_C:
+		case NFC3D_AES_BACKEND_ARMV6:
+			return true;
+#if NFC3D_AES_HAVE_AESNI
+		case NFC3D_AES_BACKEND_AESNI:
+			return nfc3d_aes_cpu_has_aesni();
+#endif
+#if NFC3D_AES_HAVE_ARMV8
+		case NFC3D_AES_BACKEND_ARMV8:
+			return nfc3d_aes_cpu_has_armv8();
+#endif
+		default:
+			return false;
+	}
+}
+
+/*
+ * Deterministic xorshift32 stream for the differential checks
+ */
+static uint32_t nfc3d_aes_test_random(uint32_t * x) {
+	*x ^= *x << 13;
+	*x ^= *x >> 17;
+	*x ^= *x << 5;
+	return *x;
+}
+
+/*
+ * Runs a backend against the table-based reference with random keys and
+ * blocks, over every stream count and an odd block count
+ */
+static bool nfc3d_aes_backend_matches_reference(nfc3d_aes_backend backend, unsigned int rounds) {
+	static const unsigned int keyBits[3] = { 128, 192, 256 };
+	mbedtls_aes_context ctx[NFC3D_AES_MAX_STREAMS];
+	const mbedtls_aes_context * ctxPtrs[NFC3D_AES_MAX_STREAMS];
+	uint8_t input[NFC3D_AES_MAX_STREAMS][5 * NFC3D_AES_BLOCK_SIZE];
+	uint8_t expected[5 * NFC3D_AES_BLOCK_SIZE];
+	uint8_t actual[NFC3D_AES_MAX_STREAMS][5 * NFC3D_AES_BLOCK_SIZE];
+	const uint8_t * inputPtrs[NFC3D_AES_MAX_STREAMS];
+	uint8_t * actualPtrs[NFC3D_AES_MAX_STREAMS];
+	uint8_t key[32];
+	uint32_t seed = 0x9E3779B9;
+	unsigned int round, stream, count, i;
+	bool matches = true;
+
+	for (round = 0; round < rounds && matches; round++) {
+		count = 1 + round % NFC3D_AES_MAX_STREAMS;
+
+		for (stream = 0; stream < count; stream++) {
+			for (i = 0; i < sizeof(key); i++) {
+				key[i] = (uint8_t) nfc3d_aes_test_random(&seed);
+			}
+			for (i = 0; i < sizeof(input[stream]); i++) {
+				input[stream][i] = (uint8_t) nfc3d_aes_test_random(&seed);
+			}
+
+			mbedtls_aes_init(&ctx[stream]);
+			mbedtls_aes_setkey_enc(&ctx[stream], key, keyBits[round % 3]);
+			ctxPtrs[stream] = &ctx[stream];
+			inputPtrs[stream] = input[stream];
+			actualPtrs[stream] = actual[stream];
+		}
+
+		nfc3d_aes_backends[backend](ctxPtrs, inputPtrs, actualPtrs, 5, count);
+
+		for (stream = 0; stream < count; stream++) {
+			for (i = 0; i < 5; i++) {
+				mbedtls_aes_encrypt_c(&ctx[stream], input[stream] + i * NFC3D_AES_BLOCK_SIZE, expected + i * NFC3D_AES_BLOCK_SIZE);
+			}
+			if (memcmp(expected, actual[stream], sizeof(expected)) != 0)
+				matches = false;
+			mbedtls_aes_free(&ctx[stream]);
+		}
+	}
+
+	memset(key, 0, sizeof(key));
+	return matches;
+}
+
+bool nfc3d_aes_backend_select(nfc3d_aes_backend backend) {
+	if (!nfc3d_aes_backend_available(backend))
+		return false;
+
+	// Never trust a backend that disagrees with the reference
+	if (!nfc3d_aes_backend_matches_reference(backend, 12))
+		return false;
+
+	__atomic_store_n(&nfc3d_aes_current, backend, __ATOMIC_RELAXED);
+	__atomic_store_n(&nfc3d_aes_blocks_impl, nfc3d_aes_backends[backend], __ATOMIC_RELEASE);
+	return true;
+}
+
+static void nfc3d_aes_backend_select_best(void) {
+	// Hardware first, then the single-table cipher on 32-bit ARM, else the reference
+	if (!nfc3d_aes_backend_select(NFC3D_AES_BACKEND_AESNI) &&
+		!nfc3d_aes_backend_select(NFC3D_AES_BACKEND_ARMV8)) {
+#if defined(__arm__)
+		if (!nfc3d_aes_backend_select(NFC3D_AES_BACKEND_ARMV6))
+#endif
+			nfc3d_aes_backend_select(NFC3D_AES_BACKEND_C);
+	}
+}
+
+static void nfc3d_aes_blocks_resolve(const mbedtls_aes_context * const * aes, const uint8_t * const * input, uint8_t * const * output, size_t blocks, size_t count) {
+	nfc3d_aes_backend_select_best();
+	nfc3d_aes_blocks()(aes, input, output, blocks, count);
+}
+
+nfc3d_aes_backend nfc3d_aes_backend_current(void) {
+	if (__atomic_load_n(&nfc3d_aes_blocks_impl, __ATOMIC_ACQUIRE) == nfc3d_aes_blocks_resolve)
+		nfc3d_aes_backend_select_best();
+	return __atomic_load_n(&nfc3d_aes_current, __ATOMIC_RELAXED);
+}
+
+/*
+ * Checks every available backend with a randomized differential run against
+ * the reference, plus the mbedtls test vectors when built with
+ * MBEDTLS_SELF_TEST. The previously selected backend is restored afterwards.
+ */
+int nfc3d_aes_backend_self_test(int verbose) {
+	nfc3d_aes_backend previous = nfc3d_aes_backend_current();
+	int backend;
+	int ret = 0;
+
+	for (backend = 0; backend < NFC3D_AES_BACKEND_COUNT; backend++) {
+		if (!nfc3d_aes_backend_available((nfc3d_aes_backend) backend)) {
+			if (verbose != 0)
+				printf("  AES backend %s: not available\n", nfc3d_aes_backend_name((nfc3d_aes_backend) backend));
+			continue;
+		}
+
+		bool passed = nfc3d_aes_backend_matches_reference((nfc3d_aes_backend) backend, 1024);
+#if defined(MBEDTLS_SELF_TEST)
+		if (passed && nfc3d_aes_backend_select((nfc3d_aes_backend) backend))
+			passed = mbedtls_aes_self_test(0) == 0;
+#endif
+
+		if (verbose != 0)
+			printf("  AES backend %s: %s\n", nfc3d_aes_backend_name((nfc3d_aes_backend) backend), passed ? "passed" : "failed");
+		if (!passed)
+			ret = 1;
+	}
+
+	nfc3d_aes_backend_select(previous);
+	return ret;
+}
+
+/*
+ * Writes successive big endian counter values, as mbedtls_aes_crypt_ctr does
+ */
+static void nfc3d_aes_ctr_counters(uint8_t * counter, uint8_t * output, size_t blocks) {
+	size_t block;
+	int i;
+
+	for (block = 0; block < blocks; block++) {
+		memcpy(output + block * NFC3D_AES_BLOCK_SIZE, counter, NFC3D_AES_BLOCK_SIZE);
+		for (i = NFC3D_AES_BLOCK_SIZE; i > 0; i--) {
+			if (++counter[i - 1] != 0)
+				break;
+		}
+	}
+}
+
+void nfc3d_aes_ctr_keystream_many(const mbedtls_aes_context * const * aes, const uint8_t * const * ivs, uint8_t * const * keystreams, size_t blocks, size_t count) {
+	uint8_t counter[NFC3D_AES_BLOCK_SIZE];
+	size_t stream, group;
+
+	for (stream = 0; stream < count; stream++) {
+		memcpy(counter, ivs[stream], sizeof(counter));
+		nfc3d_aes_ctr_counters(counter, keystreams[stream], blocks);
+	}
+
+	// Encrypt the counters in place, interleaving as many streams as the backend takes
+	for (stream = 0; stream < count; stream += group) {
+		group = count - stream < NFC3D_AES_MAX_STREAMS ? count - stream : NFC3D_AES_MAX_STREAMS;
+		nfc3d_aes_blocks()(aes + stream, (const uint8_t * const *) keystreams + stream, keystreams + stream, blocks, group);
+	}
+}
+
+void nfc3d_aes_ctr_keystream(const mbedtls_aes_context * aes, const uint8_t * iv, uint8_t * keystream, size_t blocks) {
+	nfc3d_aes_ctr_keystream_many(&aes, &iv, &keystream, blocks, 1);
+}
+
+void nfc3d_aes_xor(const uint8_t * input, const uint8_t * keystream, uint8_t * output, size_t size) {
+	size_t pos = 0;
+
+	// Word at a time; memcpy keeps it legal for unaligned buffers
+	for (; pos + sizeof(size_t) <= size; pos += sizeof(size_t)) {
+		size_t a, b;
+		memcpy(&a, input + pos, sizeof(a));
+		memcpy(&b, keystream + pos, sizeof(b));
+		a ^= b;
+		memcpy(output + pos, &a, sizeof(a));
+	}
+
+	for (; pos < size; pos++) {
+		output[pos] = input[pos] ^ keystream[pos];
+	}
+}
+
+void nfc3d_aes_ctr_xor(const mbedtls_aes_context * aes, const uint8_t * iv, const uint8_t * input, uint8_t * output, size_t size) {
+	uint8_t keystream[NFC3D_AES_CHUNK_BLOCKS * NFC3D_AES_BLOCK_SIZE];
+	uint8_t counter[NFC3D_AES_BLOCK_SIZE];
+	uint8_t * keystreamPtr = keystream;
+
+	memcpy(counter, iv, sizeof(counter));
+
+	while (size > 0) {
+		size_t chunk = size < sizeof(keystream) ? size : sizeof(keystream);
+		size_t blocks = (chunk + NFC3D_AES_BLOCK_SIZE - 1) / NFC3D_AES_BLOCK_SIZE;
+
+		nfc3d_aes_ctr_counters(counter, keystream, blocks);
+		nfc3d_aes_blocks()(&aes, (const uint8_t * const *) &keystreamPtr, &keystreamPtr, blocks, 1);
+		nfc3d_aes_xor(input, keystream, output, chunk);
+
+		input += chunk;
+		output += chunk;
+		size -= chunk;
+	}
+
+	memset(keystream, 0, sizeof(keystream));
+}
@@ -7,129 +7,815 @@
 
 #include "nfc3d/amiibo.h"
 #include "util.h"
-#include "mbedtls/md.h"
+#include "nfc3d/hmac.h"
+#include "nfc3d/aes_backend.h"
 #include "mbedtls/aes.h"
 #include <errno.h>
 
-#define HMAC_POS_DATA 0x008
-#define HMAC_POS_TAG 0x1B4
+#define HMAC_POS_DATA NFC3D_AMIIBO_DATA_HMAC_POS
+#define HMAC_POS_TAG NFC3D_AMIIBO_TAG_HMAC_POS
 
-void nfc3d_amiibo_calc_seed(const uint8_t * dump, uint8_t * key) {
-	memcpy(key + 0x00, dump + 0x029, 0x02);
+#define CIPHER_POS NFC3D_AMIIBO_ENCRYPTED_POS
+#define CIPHER_SIZE NFC3D_AMIIBO_ENCRYPTED_SIZE
+#define CIPHER_BLOCKS (NFC3D_AMIIBO_KEYSTREAM_SIZE / NFC3D_AES_BLOCK_SIZE)
+
+#define CIPHER_END (CIPHER_POS + CIPHER_SIZE)
+
+size_t nfc3d_amiibo_tag_offset(size_t internalOffset) {
+	return NFC3D_AMIIBO_TAG_OFFSET(internalOffset);
+}
+
+static size_t nfc3d_amiibo_internal_offset(size_t tagOffset) {
+	return NFC3D_AMIIBO_INTERNAL_OFFSET(tagOffset);
+}
+
+/*
+ * Reads internal offsets out of a dump in either layout. Only valid for
+ * ranges that do not cross a span.
+ */
+#define nfc3d_amiibo_at(dump, tagLayout, internalOffset) ((dump) + ((tagLayout) ? NFC3D_AMIIBO_TAG_OFFSET(internalOffset) : (internalOffset)))
+
+/*
+ * Moves one span between layouts. With a keystream, its part of the
+ * encrypted region is XORed on the way; without copy, only that part is
+ * written. Called with constant span bounds, so the branches fold away.
+ */
+static inline void nfc3d_amiibo_convert_span(const uint8_t * in, bool inTag, uint8_t * out, bool outTag, const uint8_t * keystream, bool copy, size_t intl, size_t tag, size_t size) {
+	const uint8_t * src = in + (inTag ? tag : intl);
+	uint8_t * dst = out + (outTag ? tag : intl);
+	size_t end = intl + size;
+
+	if (keystream != NULL && intl < CIPHER_END && end > CIPHER_POS) {
+		size_t head = intl < CIPHER_POS ? CIPHER_POS - intl : 0;
+		size_t body = (end < CIPHER_END ? end : CIPHER_END) - intl - head;
+
+		if (copy && dst != src) {
+			memcpy(dst, src, head);
+			memcpy(dst + head + body, src + head + body, size - head - body);
+		}
+		nfc3d_aes_xor(src + head, keystream + (intl + head - CIPHER_POS), dst + head, body);
+	} else if (copy && dst != src) {
+		memcpy(dst, src, size);
+	}
+}
+
+#define CONVERT_SPAN(copy, intl, tag, size) nfc3d_amiibo_convert_span(in, inTag, out, outTag, keystream, copy, intl, tag, size);
+
+/*
+ * Moves a dump between layouts, unrolled over the spans. With a keystream,
+ * the encrypted region is XORed on the way, so converting and en/decrypting
+ * is a single pass. in and out may be the same buffer only if the layouts
+ * are too.
+ */
+static void nfc3d_amiibo_convert(const uint8_t * in, bool inTag, uint8_t * out, bool outTag, const uint8_t * keystream) {
+	NFC3D_AMIIBO_SPANS(CONVERT_SPAN, true)
+}
+
+// Only the encrypted region, for an out that already holds the rest
+static void nfc3d_amiibo_crypt(const uint8_t * in, bool inTag, uint8_t * out, bool outTag, const uint8_t * keystream) {
+	NFC3D_AMIIBO_SPANS(CONVERT_SPAN, false)
+}
+
+/*
+ * Same permutation without a second buffer: every byte is moved along its
+ * cycle, with a bitmap of the ones already placed
+ */
+static void nfc3d_amiibo_convert_inplace(uint8_t * dump, bool toTag) {
+	uint8_t placed[(NFC3D_AMIIBO_SIZE + 7) / 8];
+	size_t start, pos;
+
+	memset(placed, 0, sizeof(placed));
+
+	for (start = 0; start < NFC3D_AMIIBO_SIZE; start++) {
+		uint8_t carry = dump[start];
+
+		if (placed[start / 8] & (1 << (start % 8)))
+			continue;
+
+		pos = start;
+		do {
+			uint8_t next;
+			pos = toTag ? nfc3d_amiibo_tag_offset(pos) : nfc3d_amiibo_internal_offset(pos);
+			next = dump[pos];
+			dump[pos] = carry;
+			carry = next;
+			placed[pos / 8] |= 1 << (pos % 8);
+		} while (pos != start);
+	}
+}
+
+void nfc3d_amiibo_tag_to_internal(const uint8_t * tag, uint8_t * intl) {
+	nfc3d_amiibo_convert(tag, true, intl, false, NULL);
+}
+
+void nfc3d_amiibo_internal_to_tag(const uint8_t * intl, uint8_t * tag) {
+	nfc3d_amiibo_convert(intl, false, tag, true, NULL);
+}
+
+void nfc3d_amiibo_tag_to_internal_inplace(uint8_t * dump) {
+	nfc3d_amiibo_convert_inplace(dump, false);
+}
+
+void nfc3d_amiibo_internal_to_tag_inplace(uint8_t * dump) {
+	nfc3d_amiibo_convert_inplace(dump, true);
+}
+
+static void nfc3d_amiibo_calc_seed_layout(const uint8_t * dump, bool tagLayout, uint8_t * key) {
+	memcpy(key + 0x00, nfc3d_amiibo_at(dump, tagLayout, NFC3D_AMIIBO_WRITE_COUNTER_POS), NFC3D_AMIIBO_WRITE_COUNTER_SIZE);
 	memset(key + 0x02, 0x00, 0x0E);
-	memcpy(key + 0x10, dump + 0x1D4, 0x08);
-	memcpy(key + 0x18, dump + 0x1D4, 0x08);
-	memcpy(key + 0x20, dump + 0x1E8, 0x20);
+	memcpy(key + 0x10, nfc3d_amiibo_at(dump, tagLayout, NFC3D_AMIIBO_UID_POS), NFC3D_AMIIBO_UID_SIZE);
+	memcpy(key + 0x18, nfc3d_amiibo_at(dump, tagLayout, NFC3D_AMIIBO_UID_POS), NFC3D_AMIIBO_UID_SIZE);
+	memcpy(key + 0x20, nfc3d_amiibo_at(dump, tagLayout, NFC3D_AMIIBO_KEYGEN_SALT_POS), NFC3D_AMIIBO_KEYGEN_SALT_SIZE);
+}
+
+void nfc3d_amiibo_calc_seed(const uint8_t * dump, uint8_t * key) {
+	nfc3d_amiibo_calc_seed_layout(dump, false, key);
 }
 
-void nfc3d_amiibo_keygen(const nfc3d_keygen_masterkeys * masterKeys, const uint8_t * dump, nfc3d_keygen_derivedkeys * derivedKeys) {
+void nfc3d_amiibo_keygen(const nfc3d_keygen_preparedkeys * masterKeys, const uint8_t * dump, nfc3d_keygen_derivedkeys * derivedKeys) {
 	uint8_t seed[NFC3D_KEYGEN_SEED_SIZE];
 
 	nfc3d_amiibo_calc_seed(dump, seed);
 	nfc3d_keygen(masterKeys, seed, derivedKeys);
 }
 
-void nfc3d_amiibo_cipher(const nfc3d_keygen_derivedkeys * keys, const uint8_t * in, uint8_t * out) {
+/*
+ * Derived keys are a pure function of the master keys and the seed, so the
+ * last few pairs are kept. Entries are matched on a hash of the seed, then on
+ * the full seed and the digests of the master keys, so no entry holds a copy
+ * of them. The cache is per thread, so it needs no locking, and lives in
+ * static storage, so it never allocates.
+ */
+typedef struct {
+	uint32_t seedHash;
+	uint32_t lastUse;	// 0 marks an empty entry
+	uint8_t seed[NFC3D_KEYGEN_SEED_SIZE];
+	uint8_t dataDigest[NFC3D_KEYGEN_DIGEST_SIZE];
+	uint8_t tagDigest[NFC3D_KEYGEN_DIGEST_SIZE];
+	nfc3d_keygen_derivedkeys dataKeys;
+	nfc3d_keygen_derivedkeys tagKeys;
+} nfc3d_amiibo_keycache_entry;
+
+static __thread nfc3d_amiibo_keycache_entry nfc3d_amiibo_keycache[NFC3D_AMIIBO_KEYCACHE_SIZE];
+static __thread uint32_t nfc3d_amiibo_keycache_clock;
+static __thread uint32_t nfc3d_amiibo_keycache_hits;
+static __thread uint32_t nfc3d_amiibo_keycache_misses;
+
+// FNV-1a
+static uint32_t nfc3d_amiibo_seed_hash(const uint8_t * seed) {
+	uint32_t hash = 0x811C9DC5;
+	size_t i;
+
+	for (i = 0; i < NFC3D_KEYGEN_SEED_SIZE; i++) {
+		hash = (hash ^ seed[i]) * 0x01000193;
+	}
+	return hash;
+}
+
+static bool nfc3d_amiibo_keycache_matches(const nfc3d_amiibo_keycache_entry * entry, const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * seed, uint32_t seedHash) {
+	return entry->lastUse != 0 && entry->seedHash == seedHash &&
+			memcmp(entry->seed, seed, NFC3D_KEYGEN_SEED_SIZE) == 0 &&
+			memcmp(entry->dataDigest, amiiboKeys->data.digest, NFC3D_KEYGEN_DIGEST_SIZE) == 0 &&
+			memcmp(entry->tagDigest, amiiboKeys->tag.digest, NFC3D_KEYGEN_DIGEST_SIZE) == 0;
+}
+
+// Counts a hit or a miss; on a hit copies the keys out and marks the entry as recently used
+static bool nfc3d_amiibo_keycache_lookup(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * seed, nfc3d_keygen_derivedkeys * dataKeys, nfc3d_keygen_derivedkeys * tagKeys) {
+	uint32_t seedHash = nfc3d_amiibo_seed_hash(seed);
+	size_t i;
+
+	for (i = 0; i < NFC3D_AMIIBO_KEYCACHE_SIZE; i++) {
+		nfc3d_amiibo_keycache_entry * entry = &nfc3d_amiibo_keycache[i];
+
+		if (nfc3d_amiibo_keycache_matches(entry, amiiboKeys, seed, seedHash)) {
+			entry->lastUse = ++nfc3d_amiibo_keycache_clock;
+			memcpy(dataKeys, &entry->dataKeys, sizeof(*dataKeys));
+			memcpy(tagKeys, &entry->tagKeys, sizeof(*tagKeys));
+			nfc3d_amiibo_keycache_hits++;
+			return true;
+		}
+	}
+	nfc3d_amiibo_keycache_misses++;
+	return false;
+}
+
+// Replaces the least recently used entry
+static void nfc3d_amiibo_keycache_insert(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * seed, const nfc3d_keygen_derivedkeys * dataKeys, const nfc3d_keygen_derivedkeys * tagKeys) {
+	nfc3d_amiibo_keycache_entry * victim = &nfc3d_amiibo_keycache[0];
+	size_t i;
+
+	for (i = 1; i < NFC3D_AMIIBO_KEYCACHE_SIZE && victim->lastUse != 0; i++) {
+		if (nfc3d_amiibo_keycache[i].lastUse < victim->lastUse) {
+			victim = &nfc3d_amiibo_keycache[i];
+		}
+	}
+
+	// On wraparound start over rather than let the ordering go wrong
+	if (nfc3d_amiibo_keycache_clock == UINT32_MAX) {
+		nfc3d_amiibo_keycache_clear();
+		victim = &nfc3d_amiibo_keycache[0];
+	}
+
+	victim->seedHash = nfc3d_amiibo_seed_hash(seed);
+	victim->lastUse = ++nfc3d_amiibo_keycache_clock;
+	memcpy(victim->seed, seed, NFC3D_KEYGEN_SEED_SIZE);
+	memcpy(victim->dataDigest, amiiboKeys->data.digest, NFC3D_KEYGEN_DIGEST_SIZE);
+	memcpy(victim->tagDigest, amiiboKeys->tag.digest, NFC3D_KEYGEN_DIGEST_SIZE);
+	memcpy(&victim->dataKeys, dataKeys, sizeof(victim->dataKeys));
+	memcpy(&victim->tagKeys, tagKeys, sizeof(victim->tagKeys));
+}
+
+void nfc3d_amiibo_keycache_clear(void) {
+	memset(nfc3d_amiibo_keycache, 0, sizeof(nfc3d_amiibo_keycache));
+	nfc3d_amiibo_keycache_clock = 0;
+}
+
+void nfc3d_amiibo_keycache_stats(uint32_t * hits, uint32_t * misses) {
+	*hits = nfc3d_amiibo_keycache_hits;
+	*misses = nfc3d_amiibo_keycache_misses;
+}
+
+// Both keysets for a seed, from the cache when possible
+static void nfc3d_amiibo_keygen_seed(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * seed, nfc3d_keygen_derivedkeys * dataKeys, nfc3d_keygen_derivedkeys * tagKeys) {
+	if (!nfc3d_amiibo_keycache_lookup(amiiboKeys, seed, dataKeys, tagKeys)) {
+		nfc3d_keygen_pair(&amiiboKeys->data, &amiiboKeys->tag, seed, dataKeys, tagKeys);
+		nfc3d_amiibo_keycache_insert(amiiboKeys, seed, dataKeys, tagKeys);
+	}
+}
+
+void nfc3d_amiibo_keygen_both(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * dump, nfc3d_keygen_derivedkeys * dataKeys, nfc3d_keygen_derivedkeys * tagKeys) {
+	uint8_t seed[NFC3D_KEYGEN_SEED_SIZE];
+
+	nfc3d_amiibo_calc_seed(dump, seed);
+	nfc3d_amiibo_keygen_seed(amiiboKeys, seed, dataKeys, tagKeys);
+}
+
+static void nfc3d_amiibo_keystream(const nfc3d_keygen_derivedkeys * keys, uint8_t * keystream) {
 	mbedtls_aes_context aes;
-	size_t nc_off = 0;
-	unsigned char nonce_counter[16];
-	unsigned char stream_block[16];
 
+	mbedtls_aes_init( &aes );
 	mbedtls_aes_setkey_enc( &aes, keys->aesKey, 128 );
-	memset(nonce_counter, 0, sizeof(nonce_counter));
-	memset(stream_block, 0, sizeof(stream_block));
-	memcpy(nonce_counter, keys->aesIV, sizeof(nonce_counter));
-	mbedtls_aes_crypt_ctr( &aes, 0x188, &nc_off, nonce_counter, stream_block, in + 0x02C, out + 0x02C );
+	nfc3d_aes_ctr_keystream(&aes, keys->aesIV, keystream, CIPHER_BLOCKS);
+	mbedtls_aes_free( &aes );
+}
 
-	memcpy(out + 0x000, in + 0x000, 0x008);
+static void nfc3d_amiibo_copy_unencrypted(const uint8_t * in, uint8_t * out) {
+	memcpy(out, in, HMAC_POS_DATA);
 	// Data signature NOT copied
-	memcpy(out + 0x028, in + 0x028, 0x004);
+	memcpy(out + HMAC_POS_DATA + NFC3D_AMIIBO_DATA_HMAC_SIZE, in + HMAC_POS_DATA + NFC3D_AMIIBO_DATA_HMAC_SIZE, CIPHER_POS - HMAC_POS_DATA - NFC3D_AMIIBO_DATA_HMAC_SIZE);
 	// Tag signature NOT copied
-	memcpy(out + 0x1D4, in + 0x1D4, 0x034);
+	memcpy(out + NFC3D_AMIIBO_TAG_SIGNED_POS, in + NFC3D_AMIIBO_TAG_SIGNED_POS, NFC3D_AMIIBO_TAG_SIGNED_SIZE);
 }
 
-void nfc3d_amiibo_tag_to_internal(const uint8_t * tag, uint8_t * intl) {
-	memcpy(intl + 0x000, tag + 0x008, 0x008);
-	memcpy(intl + 0x008, tag + 0x080, 0x020);
-	memcpy(intl + 0x028, tag + 0x010, 0x024);
-	memcpy(intl + 0x04C, tag + 0x0A0, 0x168);
-	memcpy(intl + 0x1B4, tag + 0x034, 0x020);
-	memcpy(intl + 0x1D4, tag + 0x000, 0x008);
-	memcpy(intl + 0x1DC, tag + 0x054, 0x02C);
+void nfc3d_amiibo_cipher(const nfc3d_keygen_derivedkeys * keys, const uint8_t * in, uint8_t * out) {
+	mbedtls_aes_context aes;
+
+	mbedtls_aes_init( &aes );
+	mbedtls_aes_setkey_enc( &aes, keys->aesKey, 128 );
+	nfc3d_aes_ctr_xor(&aes, keys->aesIV, in + CIPHER_POS, out + CIPHER_POS, CIPHER_SIZE);
+	mbedtls_aes_free( &aes );
+
+	nfc3d_amiibo_copy_unencrypted(in, out);
 }
 
-void nfc3d_amiibo_internal_to_tag(const uint8_t * intl, uint8_t * tag) {
-	memcpy(tag + 0x008, intl + 0x000, 0x008);
-	memcpy(tag + 0x080, intl + 0x008, 0x020);
-	memcpy(tag + 0x010, intl + 0x028, 0x024);
-	memcpy(tag + 0x0A0, intl + 0x04C, 0x168);
-	memcpy(tag + 0x034, intl + 0x1B4, 0x020);
-	memcpy(tag + 0x000, intl + 0x1D4, 0x008);
-	memcpy(tag + 0x054, intl + 0x1DC, 0x02C);
+/*
+ * Decrypts a tag layout dump into internal layout, in place if plain is tag
+ */
+static void nfc3d_amiibo_decrypt_tag(const uint8_t * tag, uint8_t * plain, const uint8_t * keystream) {
+	if (plain == tag) {
+		nfc3d_amiibo_convert(plain, true, plain, true, keystream);
+		nfc3d_amiibo_tag_to_internal_inplace(plain);
+	} else {
+		nfc3d_amiibo_convert(tag, true, plain, false, keystream);
+	}
+}
+
+/*
+ * Feeds the internal bytes [from, to) of a tag layout dump to an HMAC,
+ * decrypting the encrypted region with the keystream on the way
+ */
+static void nfc3d_amiibo_hmac_update_tag(nfc3d_hmac_sha256_ctx * ctx, const uint8_t * tag, size_t from, size_t to, const uint8_t * keystream) {
+	uint8_t chunk[64];
+	size_t pos = from;
+
+	while (pos < to) {
+		const uint8_t * src = tag + NFC3D_AMIIBO_TAG_OFFSET(pos);
+		size_t len = NFC3D_AMIIBO_SPAN_END_OF(pos) - pos;
+
+		if (len > to - pos)
+			len = to - pos;
+
+		if (keystream != NULL && pos >= CIPHER_POS && pos < CIPHER_END) {
+			if (len > CIPHER_END - pos)
+				len = CIPHER_END - pos;
+			if (len > sizeof(chunk))
+				len = sizeof(chunk);
+			nfc3d_aes_xor(src, keystream + (pos - CIPHER_POS), chunk, len);
+			nfc3d_hmac_sha256_update(ctx, chunk, len);
+		} else {
+			if (keystream != NULL && pos < CIPHER_POS && pos + len > CIPHER_POS)
+				len = CIPHER_POS - pos;
+			nfc3d_hmac_sha256_update(ctx, src, len);
+		}
+
+		pos += len;
+	}
+
+	memset(chunk, 0, sizeof(chunk));
 }
 
-bool nfc3d_amiibo_unpack(const nfc3d_amiibo_keys * amiiboKeys, const uint8_t * tag, uint8_t * plain) {
-	uint8_t internal[NFC3D_AMIIBO_SIZE];
+void nfc3d_amiibo_prepare_keys(const nfc3d_amiibo_keys * amiiboKeys, nfc3d_amiibo_preparedkeys * preparedKeys) {
+	nfc3d_keygen_prepare_keys(&amiiboKeys->data, &preparedKeys->data);
+	nfc3d_keygen_prepare_keys(&amiiboKeys->tag, &preparedKeys->tag);
+}
+
+/*
+ * Reads the tag layout directly; plain may be the same buffer as tag.
+ */
+bool nfc3d_amiibo_unpack(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * tag, uint8_t * plain) {
+	uint8_t seed[NFC3D_KEYGEN_SEED_SIZE];
+	uint8_t keystream[NFC3D_AMIIBO_KEYSTREAM_SIZE];
+	uint8_t dataHmac[32];
+	uint8_t tagHmac[32];
 	nfc3d_keygen_derivedkeys dataKeys;
 	nfc3d_keygen_derivedkeys tagKeys;
 
-	// Convert format
-	nfc3d_amiibo_tag_to_internal(tag, internal);
-
 	// Generate keys
-	nfc3d_amiibo_keygen(&amiiboKeys->data, internal, &dataKeys);
-	nfc3d_amiibo_keygen(&amiiboKeys->tag, internal, &tagKeys);
+	nfc3d_amiibo_calc_seed_layout(tag, true, seed);
+	nfc3d_amiibo_keygen_seed(amiiboKeys, seed, &dataKeys, &tagKeys);
+	nfc3d_amiibo_keystream(&dataKeys, keystream);
 
-	// Decrypt
-	nfc3d_amiibo_cipher(&dataKeys, internal, plain);
+	// Keep the stored HMACs, plain may overwrite them
+	memcpy(dataHmac, tag + NFC3D_AMIIBO_DATA_HMAC_TAG_POS, sizeof(dataHmac));
+	memcpy(tagHmac, tag + NFC3D_AMIIBO_TAG_HMAC_TAG_POS, sizeof(tagHmac));
+
+	// Decrypt and convert format
+	nfc3d_amiibo_decrypt_tag(tag, plain, keystream);
+	memset(keystream, 0, sizeof(keystream));
 
 	// Regenerate tag HMAC. Note: order matters, data HMAC depends on tag HMAC!
-	mbedtls_md_hmac( mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), tagKeys.hmacKey, sizeof(tagKeys.hmacKey),	
-			 plain + 0x1D4, 0x34, plain + HMAC_POS_TAG );
+	nfc3d_hmac_sha256(tagKeys.hmacKey, sizeof(tagKeys.hmacKey), plain + NFC3D_AMIIBO_TAG_SIGNED_POS, NFC3D_AMIIBO_TAG_SIGNED_SIZE, plain + HMAC_POS_TAG);
 
 	// Regenerate data HMAC
-	mbedtls_md_hmac( mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), dataKeys.hmacKey, sizeof(dataKeys.hmacKey),	
-			 plain + 0x029, 0x1DF, plain + HMAC_POS_DATA );
+	nfc3d_hmac_sha256(dataKeys.hmacKey, sizeof(dataKeys.hmacKey), plain + NFC3D_AMIIBO_DATA_SIGNED_POS, NFC3D_AMIIBO_DATA_SIGNED_SIZE, plain + HMAC_POS_DATA);
 
 	return
-			memcmp(plain + HMAC_POS_DATA, internal + HMAC_POS_DATA, 32) == 0 &&
-			memcmp(plain + HMAC_POS_TAG, internal + HMAC_POS_TAG, 32) == 0;
+			memcmp(plain + HMAC_POS_DATA, dataHmac, 32) == 0 &&
+			memcmp(plain + HMAC_POS_TAG, tagHmac, 32) == 0;
+}
+
+/*
+ * Unpacks one full batch with every SHA-256 running on the 8-lane kernel
+ */
+static void nfc3d_amiibo_unpack_x8(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * const * tags, uint8_t * const * plains, bool * results) {
+	uint8_t storedHmacs[NFC3D_SHA256X8_LANES][2][32];
+	uint8_t seeds[NFC3D_SHA256X8_LANES][NFC3D_KEYGEN_SEED_SIZE];
+	nfc3d_keygen_derivedkeys dataKeys[NFC3D_SHA256X8_LANES];
+	nfc3d_keygen_derivedkeys tagKeys[NFC3D_SHA256X8_LANES];
+	nfc3d_hmac_sha256_key hmacKeys[NFC3D_SHA256X8_LANES];
+	const uint8_t * seedPtrs[NFC3D_SHA256X8_LANES];
+	nfc3d_keygen_derivedkeys * dataKeyPtrs[NFC3D_SHA256X8_LANES];
+	nfc3d_keygen_derivedkeys * tagKeyPtrs[NFC3D_SHA256X8_LANES];
+	nfc3d_hmac_sha256_key * hmacKeyPtrs[NFC3D_SHA256X8_LANES];
+	const uint8_t * rawKeys[NFC3D_SHA256X8_LANES];
+	const uint8_t * inputs[NFC3D_SHA256X8_LANES];
+	uint8_t * outputs[NFC3D_SHA256X8_LANES];
+	uint8_t keystreams[NFC3D_SHA256X8_LANES][CIPHER_BLOCKS * NFC3D_AES_BLOCK_SIZE];
+	mbedtls_aes_context aes[NFC3D_SHA256X8_LANES];
+	const mbedtls_aes_context * aesPtrs[NFC3D_SHA256X8_LANES];
+	unsigned int lane;
+
+	for (lane = 0; lane < NFC3D_SHA256X8_LANES; lane++) {
+		nfc3d_amiibo_calc_seed_layout(tags[lane], true, seeds[lane]);
+		memcpy(storedHmacs[lane][0], tags[lane] + NFC3D_AMIIBO_DATA_HMAC_TAG_POS, 32);
+		memcpy(storedHmacs[lane][1], tags[lane] + NFC3D_AMIIBO_TAG_HMAC_TAG_POS, 32);
+		seedPtrs[lane] = seeds[lane];
+		dataKeyPtrs[lane] = &dataKeys[lane];
+		tagKeyPtrs[lane] = &tagKeys[lane];
+		hmacKeyPtrs[lane] = &hmacKeys[lane];
+	}
+
+	// Generate keys
+	nfc3d_keygen_x8(&amiiboKeys->data, seedPtrs, dataKeyPtrs);
+	nfc3d_keygen_x8(&amiiboKeys->tag, seedPtrs, tagKeyPtrs);
+
+	// Decrypt and convert format, with the keystreams of several dumps interleaved on the AES backend
+	for (lane = 0; lane < NFC3D_SHA256X8_LANES; lane++) {
+		mbedtls_aes_init( &aes[lane] );
+		mbedtls_aes_setkey_enc( &aes[lane], dataKeys[lane].aesKey, 128 );
+		aesPtrs[lane] = &aes[lane];
+		rawKeys[lane] = dataKeys[lane].aesIV;
+		outputs[lane] = keystreams[lane];
+	}
+	nfc3d_aes_ctr_keystream_many(aesPtrs, rawKeys, outputs, CIPHER_BLOCKS, NFC3D_SHA256X8_LANES);
+	for (lane = 0; lane < NFC3D_SHA256X8_LANES; lane++) {
+		nfc3d_amiibo_decrypt_tag(tags[lane], plains[lane], keystreams[lane]);
+		mbedtls_aes_free( &aes[lane] );
+	}
+	memset(keystreams, 0, sizeof(keystreams));
+
+	// Regenerate tag HMACs. Note: order matters, data HMAC depends on tag HMAC!
+	for (lane = 0; lane < NFC3D_SHA256X8_LANES; lane++) {
+		rawKeys[lane] = tagKeys[lane].hmacKey;
+		inputs[lane] = plains[lane] + NFC3D_AMIIBO_TAG_SIGNED_POS;
+		outputs[lane] = plains[lane] + HMAC_POS_TAG;
+	}
+	nfc3d_hmac_sha256_setkey_x8(hmacKeyPtrs, rawKeys, sizeof(tagKeys[0].hmacKey));
+	nfc3d_hmac_sha256_x8((const nfc3d_hmac_sha256_key * const *) hmacKeyPtrs, inputs, NFC3D_AMIIBO_TAG_SIGNED_SIZE, outputs);
+
+	// Regenerate data HMACs
+	for (lane = 0; lane < NFC3D_SHA256X8_LANES; lane++) {
+		rawKeys[lane] = dataKeys[lane].hmacKey;
+		inputs[lane] = plains[lane] + NFC3D_AMIIBO_DATA_SIGNED_POS;
+		outputs[lane] = plains[lane] + HMAC_POS_DATA;
+	}
+	nfc3d_hmac_sha256_setkey_x8(hmacKeyPtrs, rawKeys, sizeof(dataKeys[0].hmacKey));
+	nfc3d_hmac_sha256_x8((const nfc3d_hmac_sha256_key * const *) hmacKeyPtrs, inputs, NFC3D_AMIIBO_DATA_SIGNED_SIZE, outputs);
+
+	for (lane = 0; lane < NFC3D_SHA256X8_LANES; lane++) {
+		results[lane] =
+				memcmp(plains[lane] + HMAC_POS_DATA, storedHmacs[lane][0], 32) == 0 &&
+				memcmp(plains[lane] + HMAC_POS_TAG, storedHmacs[lane][1], 32) == 0;
+		nfc3d_hmac_sha256_key_cleanup(&hmacKeys[lane]);
+	}
+
+	memset(dataKeys, 0, sizeof(dataKeys));
+	memset(tagKeys, 0, sizeof(tagKeys));
+}
+
+/*
+ * Same output as calling nfc3d_amiibo_unpack on every dump. Full groups of
+ * eight go through the multi-buffer path, the remainder is done one by one.
+ */
+void nfc3d_amiibo_unpack_many(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * const * tags, uint8_t * const * plains, bool * results, size_t count) {
+	size_t i = 0;
+
+	for (; i + NFC3D_SHA256X8_LANES <= count; i += NFC3D_SHA256X8_LANES) {
+		nfc3d_amiibo_unpack_x8(amiiboKeys, tags + i, plains + i, results + i);
+	}
+
+	for (; i < count; i++) {
+		results[i] = nfc3d_amiibo_unpack(amiiboKeys, tags[i], plains[i]);
+	}
 }
 
-void nfc3d_amiibo_pack(const nfc3d_amiibo_keys * amiiboKeys, const uint8_t * plain, uint8_t * tag) {
-	uint8_t cipher[NFC3D_AMIIBO_SIZE];
+bool nfc3d_amiibo_verify(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * tag) {
+	uint8_t seed[NFC3D_KEYGEN_SEED_SIZE];
+	uint8_t hmac[32];
+	uint8_t keystream[NFC3D_AMIIBO_KEYSTREAM_SIZE];
 	nfc3d_keygen_derivedkeys tagKeys;
 	nfc3d_keygen_derivedkeys dataKeys;
+	nfc3d_hmac_sha256_key hmacKey;
+	nfc3d_hmac_sha256_ctx ctx;
+	bool valid, cached;
 
-	// Generate keys
-	nfc3d_amiibo_keygen(&amiiboKeys->tag, plain, &tagKeys);
-	nfc3d_amiibo_keygen(&amiiboKeys->data, plain, &dataKeys);
+	nfc3d_amiibo_calc_seed_layout(tag, true, seed);
+	cached = nfc3d_amiibo_keycache_lookup(amiiboKeys, seed, &dataKeys, &tagKeys);
 
-	// Generate tag HMAC
-	mbedtls_md_hmac( mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), tagKeys.hmacKey, sizeof(tagKeys.hmacKey),	
-			 plain + 0x1D4, 0x34, cipher + HMAC_POS_TAG );
+	// The tag HMAC only covers the unencrypted UID/char ID block, so it can be
+	// checked with the tag keys alone, before any decryption
+	if (!cached) {
+		nfc3d_keygen(&amiiboKeys->tag, seed, &tagKeys);
+	}
+	nfc3d_hmac_sha256_setkey(&hmacKey, tagKeys.hmacKey, sizeof(tagKeys.hmacKey));
+	nfc3d_hmac_sha256_starts(&ctx, &hmacKey);
+	nfc3d_amiibo_hmac_update_tag(&ctx, tag, NFC3D_AMIIBO_TAG_SIGNED_POS, NFC3D_AMIIBO_SIZE, NULL);
+	nfc3d_hmac_sha256_finish(&ctx, hmac);
+	nfc3d_hmac_sha256_key_cleanup(&hmacKey);
+	if (memcmp(hmac, tag + NFC3D_AMIIBO_TAG_HMAC_TAG_POS, sizeof(hmac)) != 0) {
+		return false;
+	}
+
+	// Generate data keys. Whole keystream in one backend call, so the blocks pipeline
+	if (!cached) {
+		nfc3d_keygen(&amiiboKeys->data, seed, &dataKeys);
+		nfc3d_amiibo_keycache_insert(amiiboKeys, seed, &dataKeys, &tagKeys);
+	}
+	nfc3d_amiibo_keystream(&dataKeys, keystream);
+
+	// Decrypt straight from the tag layout into the data HMAC, so the plaintext is never materialized
+	nfc3d_hmac_sha256_setkey(&hmacKey, dataKeys.hmacKey, sizeof(dataKeys.hmacKey));
+	nfc3d_hmac_sha256_starts(&ctx, &hmacKey);
+	nfc3d_amiibo_hmac_update_tag(&ctx, tag, NFC3D_AMIIBO_DATA_SIGNED_POS, NFC3D_AMIIBO_SIZE, keystream);
+	nfc3d_hmac_sha256_finish(&ctx, hmac);
+
+	valid = memcmp(hmac, tag + NFC3D_AMIIBO_DATA_HMAC_TAG_POS, sizeof(hmac)) == 0;
 
-	// Init mbedtls HMAC context
-	mbedtls_md_context_t ctx;
-	mbedtls_md_init( &ctx );
-	mbedtls_md_setup( &ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1 );
+	// Cleanup
+	nfc3d_hmac_sha256_key_cleanup(&hmacKey);
+	memset(keystream, 0, sizeof(keystream));
+
+	return valid;
+}
+
+/*
+ * Writes both HMACs of a plaintext dump. Note: order matters, data HMAC
+ * depends on tag HMAC!
+ */
+static void nfc3d_amiibo_sign(const nfc3d_hmac_sha256_key * tagHmacKey, const nfc3d_hmac_sha256_key * dataHmacKey, const uint8_t * plain, uint8_t * tagHmac, uint8_t * dataHmac) {
+	nfc3d_hmac_sha256_ctx ctx;
+
+	// Generate tag HMAC
+	nfc3d_hmac_sha256_keyed(tagHmacKey, plain + NFC3D_AMIIBO_TAG_SIGNED_POS, NFC3D_AMIIBO_TAG_SIGNED_SIZE, tagHmac);
 
 	// Generate data HMAC
-	mbedtls_md_hmac_starts( &ctx, dataKeys.hmacKey, sizeof(dataKeys.hmacKey) );
-	mbedtls_md_hmac_update( &ctx, plain + 0x029, 0x18B ); // Data
-	mbedtls_md_hmac_update( &ctx, cipher + HMAC_POS_TAG, 0x20 ); // Tag HMAC
-	mbedtls_md_hmac_update( &ctx, plain + 0x1D4, 0x34 ); // Here be dragons
+	nfc3d_hmac_sha256_starts(&ctx, dataHmacKey);
+	nfc3d_hmac_sha256_update(&ctx, plain + NFC3D_AMIIBO_DATA_SIGNED_POS, HMAC_POS_TAG - NFC3D_AMIIBO_DATA_SIGNED_POS); // Data
+	nfc3d_hmac_sha256_update(&ctx, tagHmac, NFC3D_AMIIBO_TAG_HMAC_SIZE); // Tag HMAC
+	nfc3d_hmac_sha256_update(&ctx, plain + NFC3D_AMIIBO_TAG_SIGNED_POS, NFC3D_AMIIBO_TAG_SIGNED_SIZE); // Here be dragons
+	nfc3d_hmac_sha256_finish(&ctx, dataHmac);
+}
+
+/*
+ * Writes the tag layout directly; tag may be the same buffer as plain.
+ */
+void nfc3d_amiibo_pack(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * plain, uint8_t * tag) {
+	uint8_t keystream[NFC3D_AMIIBO_KEYSTREAM_SIZE];
+	uint8_t dataHmac[32];
+	uint8_t tagHmac[32];
+	nfc3d_keygen_derivedkeys tagKeys;
+	nfc3d_keygen_derivedkeys dataKeys;
+	nfc3d_hmac_sha256_key tagHmacKey;
+	nfc3d_hmac_sha256_key dataHmacKey;
+
+	// Generate keys
+	nfc3d_amiibo_keygen_both(amiiboKeys, plain, &dataKeys, &tagKeys);
+	nfc3d_amiibo_keystream(&dataKeys, keystream);
 
-	mbedtls_md_hmac_finish( &ctx, cipher + HMAC_POS_DATA );
+	// Generate HMACs (keys live on the stack, no heap involved)
+	nfc3d_hmac_sha256_setkey(&tagHmacKey, tagKeys.hmacKey, sizeof(tagKeys.hmacKey));
+	nfc3d_hmac_sha256_setkey(&dataHmacKey, dataKeys.hmacKey, sizeof(dataKeys.hmacKey));
+	nfc3d_amiibo_sign(&tagHmacKey, &dataHmacKey, plain, tagHmac, dataHmac);
 
 	// HMAC cleanup
-	mbedtls_md_free( &ctx );
+	nfc3d_hmac_sha256_key_cleanup(&tagHmacKey);
+	nfc3d_hmac_sha256_key_cleanup(&dataHmacKey);
+
+	// Encrypt and convert back to hardware
+	if (tag == plain) {
+		nfc3d_amiibo_convert(tag, false, tag, false, keystream);
+		memcpy(tag + HMAC_POS_DATA, dataHmac, sizeof(dataHmac));
+		memcpy(tag + HMAC_POS_TAG, tagHmac, sizeof(tagHmac));
+		nfc3d_amiibo_internal_to_tag_inplace(tag);
+	} else {
+		nfc3d_amiibo_convert(plain, false, tag, true, keystream);
+		memcpy(tag + NFC3D_AMIIBO_DATA_HMAC_TAG_POS, dataHmac, sizeof(dataHmac));
+		memcpy(tag + NFC3D_AMIIBO_TAG_HMAC_TAG_POS, tagHmac, sizeof(tagHmac));
+	}
+
+	memset(keystream, 0, sizeof(keystream));
+}
+
+/*
+ * Derives the keys for session->seed, keeping only what packing needs: the
+ * HMAC midstates and the whole CTR keystream
+ */
+static void nfc3d_amiibo_session_keygen(const nfc3d_amiibo_preparedkeys * amiiboKeys, nfc3d_amiibo_session * session) {
+	nfc3d_keygen_derivedkeys dataKeys;
+	nfc3d_keygen_derivedkeys tagKeys;
+
+	nfc3d_amiibo_keygen_seed(amiiboKeys, session->seed, &dataKeys, &tagKeys);
+	nfc3d_amiibo_keystream(&dataKeys, session->keystream);
+
+	nfc3d_hmac_sha256_setkey(&session->tagHmacKey, tagKeys.hmacKey, sizeof(tagKeys.hmacKey));
+	nfc3d_hmac_sha256_setkey(&session->dataHmacKey, dataKeys.hmacKey, sizeof(dataKeys.hmacKey));
+
+	memset(&dataKeys, 0, sizeof(dataKeys));
+	memset(&tagKeys, 0, sizeof(tagKeys));
+}
+
+/*
+ * Keys the session from a tag layout dump of which only the first
+ * NFC3D_AMIIBO_SEED_TAG_END bytes need to be there yet, so keygen can run
+ * while the rest of the tag is still being read
+ */
+void nfc3d_amiibo_session_begin(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * tagHead, nfc3d_amiibo_session * session) {
+	nfc3d_amiibo_calc_seed_layout(tagHead, true, session->seed);
+	nfc3d_amiibo_session_keygen(amiiboKeys, session);
+	session->valid = false;
+}
+
+/*
+ * Finishes an unpack started with nfc3d_amiibo_session_begin once the whole
+ * dump is in. Should the seed bytes have changed in between, it rekeys.
+ */
+bool nfc3d_amiibo_session_finish(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * tag, uint8_t * plain, nfc3d_amiibo_session * session) {
+	uint8_t seed[NFC3D_KEYGEN_SEED_SIZE];
+
+	// Convert format
+	nfc3d_amiibo_tag_to_internal(tag, session->internal);
+
+	nfc3d_amiibo_calc_seed(session->internal, seed);
+	if (memcmp(seed, session->seed, sizeof(seed)) != 0) {
+		memcpy(session->seed, seed, sizeof(seed));
+		nfc3d_amiibo_session_keygen(amiiboKeys, session);
+	}
+
+	// Decrypt
+	nfc3d_aes_xor(session->internal + CIPHER_POS, session->keystream, plain + CIPHER_POS, CIPHER_SIZE);
+	nfc3d_amiibo_copy_unencrypted(session->internal, plain);
+
+	// Regenerate HMACs
+	nfc3d_amiibo_sign(&session->tagHmacKey, &session->dataHmacKey, plain, plain + HMAC_POS_TAG, plain + HMAC_POS_DATA);
+	memcpy(session->plain, plain, NFC3D_AMIIBO_SIZE);
+
+	// Only an authentic dump is worth patching later
+	session->valid =
+			memcmp(plain + HMAC_POS_DATA, session->internal + HMAC_POS_DATA, 32) == 0 &&
+			memcmp(plain + HMAC_POS_TAG, session->internal + HMAC_POS_TAG, 32) == 0;
+	return session->valid;
+}
 
-	// Encrypt
-	nfc3d_amiibo_cipher(&dataKeys, plain, cipher);
+/*
+ * Same as nfc3d_amiibo_unpack, but remembers the keys and keystream so
+ * nfc3d_amiibo_pack_session can skip keygen and AES for the same dump
+ */
+bool nfc3d_amiibo_unpack_session(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * tag, uint8_t * plain, nfc3d_amiibo_session * session) {
+	nfc3d_amiibo_session_begin(amiiboKeys, tag, session);
+	return nfc3d_amiibo_session_finish(amiiboKeys, tag, plain, session);
+}
+
+/*
+ * Same output as nfc3d_amiibo_pack. While the seed (salt, UID) is the one the
+ * session was keyed with, only the runs of bytes that differ from the last
+ * unpack/pack are re-XORed with the stored keystream; otherwise the session
+ * is rekeyed first.
+ */
+void nfc3d_amiibo_pack_session(const nfc3d_amiibo_preparedkeys * amiiboKeys, nfc3d_amiibo_session * session, const uint8_t * plain, uint8_t * tag) {
+	uint8_t seed[NFC3D_KEYGEN_SEED_SIZE];
+	size_t pos, end;
+
+	nfc3d_amiibo_calc_seed(plain, seed);
+
+	if (!session->valid || memcmp(seed, session->seed, sizeof(seed)) != 0) {
+		// New keys, so everything gets encrypted
+		memcpy(session->seed, seed, sizeof(seed));
+		nfc3d_amiibo_session_keygen(amiiboKeys, session);
+		nfc3d_aes_xor(plain + CIPHER_POS, session->keystream, session->internal + CIPHER_POS, CIPHER_SIZE);
+		session->valid = true;
+	} else {
+		for (pos = CIPHER_POS; pos < CIPHER_POS + CIPHER_SIZE; pos = end) {
+			while (pos < CIPHER_POS + CIPHER_SIZE && plain[pos] == session->plain[pos])
+				pos++;
+			for (end = pos; end < CIPHER_POS + CIPHER_SIZE && plain[end] != session->plain[end]; end++)
+				;
+			nfc3d_aes_xor(plain + pos, session->keystream + (pos - CIPHER_POS), session->internal + pos, end - pos);
+		}
+	}
+
+	nfc3d_amiibo_copy_unencrypted(plain, session->internal);
+	nfc3d_amiibo_sign(&session->tagHmacKey, &session->dataHmacKey, plain, session->internal + HMAC_POS_TAG, session->internal + HMAC_POS_DATA);
+	memcpy(session->plain, plain, NFC3D_AMIIBO_SIZE);
 
 	// Convert back to hardware
-	nfc3d_amiibo_internal_to_tag(cipher, tag);
+	nfc3d_amiibo_internal_to_tag(session->internal, tag);
+}
+
+void nfc3d_amiibo_session_cleanup(nfc3d_amiibo_session * session) {
+	nfc3d_hmac_sha256_key_cleanup(&session->tagHmacKey);
+	nfc3d_hmac_sha256_key_cleanup(&session->dataHmacKey);
+	memset(session, 0, sizeof(*session));
+}
+
+void nfc3d_amiibo_uid7_to_uid9(const uint8_t * uid7, uint8_t * uid9) {
+	uid9[0] = uid7[0];
+	uid9[1] = uid7[1];
+	uid9[2] = uid7[2];
+	uid9[3] = 0x88 ^ uid7[0] ^ uid7[1] ^ uid7[2];
+	uid9[4] = uid7[3];
+	uid9[5] = uid7[4];
+	uid9[6] = uid7[5];
+	uid9[7] = uid7[6];
+	uid9[8] = uid7[3] ^ uid7[4] ^ uid7[5] ^ uid7[6];
+}
+
+/*
+ * Stores a 9 byte UID in a plain (internal format) dump. The second BCC byte
+ * lives apart from the rest, at the very start.
+ */
+void nfc3d_amiibo_set_uid(uint8_t * plain, const uint8_t * uid9) {
+	memcpy(nfc3d_amiibo_intl_uid(plain), uid9, NFC3D_AMIIBO_UID_SIZE);
+	nfc3d_amiibo_intl_bcc1(plain)[0] = uid9[8];
+}
+
+/*
+ * Packs one plain dump for up to eight UIDs at once. Everything that does not
+ * depend on the UID is done by the caller: the seed template, and the
+ * plaintext with its unencrypted bytes already in place in tag layout.
+ */
+static void nfc3d_amiibo_pack_uids_x8(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * plain, const uint8_t * seedTemplate, const uint8_t * tagTemplate, const uint8_t * const * uids, uint8_t * const * tags) {
+	uint8_t lanePlain[NFC3D_SHA256X8_LANES][NFC3D_AMIIBO_SIZE];
+	uint8_t seeds[NFC3D_SHA256X8_LANES][NFC3D_KEYGEN_SEED_SIZE];
+	uint8_t keystreams[NFC3D_SHA256X8_LANES][NFC3D_AMIIBO_KEYSTREAM_SIZE];
+	nfc3d_keygen_derivedkeys dataKeys[NFC3D_SHA256X8_LANES];
+	nfc3d_keygen_derivedkeys tagKeys[NFC3D_SHA256X8_LANES];
+	nfc3d_hmac_sha256_key hmacKeys[NFC3D_SHA256X8_LANES];
+	mbedtls_aes_context aes[NFC3D_SHA256X8_LANES];
+	const mbedtls_aes_context * aesPtrs[NFC3D_SHA256X8_LANES];
+	const uint8_t * seedPtrs[NFC3D_SHA256X8_LANES];
+	nfc3d_keygen_derivedkeys * dataKeyPtrs[NFC3D_SHA256X8_LANES];
+	nfc3d_keygen_derivedkeys * tagKeyPtrs[NFC3D_SHA256X8_LANES];
+	nfc3d_hmac_sha256_key * hmacKeyPtrs[NFC3D_SHA256X8_LANES];
+	const uint8_t * rawKeys[NFC3D_SHA256X8_LANES];
+	const uint8_t * inputs[NFC3D_SHA256X8_LANES];
+	uint8_t * outputs[NFC3D_SHA256X8_LANES];
+	unsigned int lane;
+
+	// The UID is in the seed twice
+	for (lane = 0; lane < NFC3D_SHA256X8_LANES; lane++) {
+		memcpy(seeds[lane], seedTemplate, NFC3D_KEYGEN_SEED_SIZE);
+		memcpy(seeds[lane] + 0x10, uids[lane], 0x08);
+		memcpy(seeds[lane] + 0x18, uids[lane], 0x08);
+		seedPtrs[lane] = seeds[lane];
+		dataKeyPtrs[lane] = &dataKeys[lane];
+		tagKeyPtrs[lane] = &tagKeys[lane];
+		hmacKeyPtrs[lane] = &hmacKeys[lane];
+	}
+
+	// Generate keys
+	nfc3d_keygen_x8(&amiiboKeys->data, seedPtrs, dataKeyPtrs);
+	nfc3d_keygen_x8(&amiiboKeys->tag, seedPtrs, tagKeyPtrs);
+
+	// Encrypt straight into tag layout
+	for (lane = 0; lane < NFC3D_SHA256X8_LANES; lane++) {
+		mbedtls_aes_init( &aes[lane] );
+		mbedtls_aes_setkey_enc( &aes[lane], dataKeys[lane].aesKey, 128 );
+		aesPtrs[lane] = &aes[lane];
+		rawKeys[lane] = dataKeys[lane].aesIV;
+		outputs[lane] = keystreams[lane];
+	}
+	nfc3d_aes_ctr_keystream_many(aesPtrs, rawKeys, outputs, CIPHER_BLOCKS, NFC3D_SHA256X8_LANES);
+	for (lane = 0; lane < NFC3D_SHA256X8_LANES; lane++) {
+		memcpy(tags[lane], tagTemplate, NFC3D_AMIIBO_SIZE);
+		nfc3d_amiibo_crypt(plain, false, tags[lane], true, keystreams[lane]);
+		memcpy(nfc3d_amiibo_tag_uid(tags[lane]), uids[lane], NFC3D_AMIIBO_UID_SIZE);
+		nfc3d_amiibo_tag_bcc1(tags[lane])[0] = uids[lane][8];
+		mbedtls_aes_free( &aes[lane] );
+	}
+	memset(keystreams, 0, sizeof(keystreams));
+
+	// The HMACs cover the UID, so they need a plaintext per lane
+	for (lane = 0; lane < NFC3D_SHA256X8_LANES; lane++) {
+		memcpy(lanePlain[lane], plain, NFC3D_AMIIBO_SIZE);
+		nfc3d_amiibo_set_uid(lanePlain[lane], uids[lane]);
+	}
+
+	// Generate tag HMACs. Note: order matters, data HMAC depends on tag HMAC!
+	for (lane = 0; lane < NFC3D_SHA256X8_LANES; lane++) {
+		rawKeys[lane] = tagKeys[lane].hmacKey;
+		inputs[lane] = lanePlain[lane] + NFC3D_AMIIBO_TAG_SIGNED_POS;
+		outputs[lane] = lanePlain[lane] + HMAC_POS_TAG;
+	}
+	nfc3d_hmac_sha256_setkey_x8(hmacKeyPtrs, rawKeys, sizeof(tagKeys[0].hmacKey));
+	nfc3d_hmac_sha256_x8((const nfc3d_hmac_sha256_key * const *) hmacKeyPtrs, inputs, NFC3D_AMIIBO_TAG_SIGNED_SIZE, outputs);
+
+	// Generate data HMACs
+	for (lane = 0; lane < NFC3D_SHA256X8_LANES; lane++) {
+		memcpy(nfc3d_amiibo_tag_tag_hmac(tags[lane]), lanePlain[lane] + HMAC_POS_TAG, NFC3D_AMIIBO_TAG_HMAC_SIZE);
+		rawKeys[lane] = dataKeys[lane].hmacKey;
+		inputs[lane] = lanePlain[lane] + NFC3D_AMIIBO_DATA_SIGNED_POS;
+		outputs[lane] = nfc3d_amiibo_tag_data_hmac(tags[lane]);
+	}
+	nfc3d_hmac_sha256_setkey_x8(hmacKeyPtrs, rawKeys, sizeof(dataKeys[0].hmacKey));
+	nfc3d_hmac_sha256_x8((const nfc3d_hmac_sha256_key * const *) hmacKeyPtrs, inputs, NFC3D_AMIIBO_DATA_SIGNED_SIZE, outputs);
+
+	for (lane = 0; lane < NFC3D_SHA256X8_LANES; lane++) {
+		nfc3d_hmac_sha256_key_cleanup(&hmacKeys[lane]);
+	}
+	memset(dataKeys, 0, sizeof(dataKeys));
+	memset(tagKeys, 0, sizeof(tagKeys));
+}
+
+/*
+ * Packs the same plain dump once per 9 byte UID (see nfc3d_amiibo_uid7_to_uid9),
+ * same output as nfc3d_amiibo_set_uid + nfc3d_amiibo_pack for each of them.
+ * A short last group is padded with its final UID and the extra output dropped.
+ */
+void nfc3d_amiibo_pack_uids(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * plain, const uint8_t * const * uids, uint8_t * const * tags, size_t count) {
+	uint8_t seedTemplate[NFC3D_KEYGEN_SEED_SIZE];
+	uint8_t tagTemplate[NFC3D_AMIIBO_SIZE];
+	uint8_t scratch[NFC3D_AMIIBO_SIZE];
+	const uint8_t * groupUids[NFC3D_SHA256X8_LANES];
+	uint8_t * groupTags[NFC3D_SHA256X8_LANES];
+	size_t i;
+	unsigned int lane;
+
+	// UID independent part of the seed, and the unencrypted bytes already permuted
+	nfc3d_amiibo_calc_seed(plain, seedTemplate);
+	nfc3d_amiibo_internal_to_tag(plain, tagTemplate);
+
+	for (i = 0; i < count; i += NFC3D_SHA256X8_LANES) {
+		for (lane = 0; lane < NFC3D_SHA256X8_LANES; lane++) {
+			if (i + lane < count) {
+				groupUids[lane] = uids[i + lane];
+				groupTags[lane] = tags[i + lane];
+			} else {
+				groupUids[lane] = uids[count - 1];
+				groupTags[lane] = scratch;
+			}
+		}
+		nfc3d_amiibo_pack_uids_x8(amiiboKeys, plain, seedTemplate, tagTemplate, groupUids, groupTags);
+	}
 }
 
 bool nfc3d_amiibo_load_keys(nfc3d_amiibo_keys * amiiboKeys, const char * path) {
@@ -6,81 +6,126 @@
 #include "nfc3d/keygen.h"
 #include "nfc3d/amitool.h"
 
-static nfc3d_amiibo_keys keys;
+static nfc3d_amiibo_preparedkeys keys; //master keys plus their HMAC midstates, computed once on load
 
 char CHECKSUM_UNFIXED[]= { 0x86,0x81,0x06,0x13,0x59,0x41,0xCB,0xCA,0xB3,0x55,0x2B,0xD1,0x48,0x80,0xA7,0xA3,0x43,0x04,0xEF,0x34,0x09,0x58,0xA6,0x99,0x8B,0x61,0xA3,0x8B,0xA3,0xCE,0x13,0xD3 };
 
 char CHECKSUM_LOCKED[] = { 0xB4,0x87,0x27,0x79,0x7C,0xD2,0x54,0x82,0x00,0xB9,0x9C,0x66,0x5B,0x20,0xA7,0x81,0x90,0x47,0x01,0x63,0xCC,0xB8,0xE5,0x68,0x21,0x49,0xF1,0xB2,0xF7,0xA0,0x06,0xCF };
 
-int amitool_setKeys(uint8_t* keydata, int len) {
-	if (sizeof(keys) != len)
+//the amiibo data itself is converted straight into the destination, only what follows it is copied
+static void copyExtra(uint8_t* tag, int taglen, uint8_t* rdata) {
+	if (rdata != tag && taglen > NFC3D_AMIIBO_SIZE)
+		memcpy(rdata + NFC3D_AMIIBO_SIZE, tag + NFC3D_AMIIBO_SIZE, taglen - NFC3D_AMIIBO_SIZE);
+}
+
+//checks one 80 byte master key file against its known checksum and prepares it
+static int prepareKeyHalf(uint8_t* keydata, int len, const char* expected, nfc3d_keygen_preparedkeys* out) {
+	if (sizeof(nfc3d_keygen_masterkeys) != len)
+		return -2;
+	
+	uint8_t checksum[32]; 
+	mbedtls_sha256(keydata, len, checksum, 0);
+	
+	if (memcmp(expected, checksum, sizeof(checksum)))
+		return -2;
+	
+	nfc3d_keygen_prepare_keys((const nfc3d_keygen_masterkeys *) keydata, out);
+	return 0;
+}
+
+int amitool_prepareKeys(uint8_t* keydata, int len, nfc3d_amiibo_preparedkeys* out) {
+	if (sizeof(nfc3d_amiibo_keys) != len)
 		return -1;
 	
 	//we allow for the two keys to be in any order in the file
 	
-	int res = amitool_setKeysUnfixed(keydata, 80);
-	if (res == 0) {
-		res = amitool_setKeysFixed(&keydata[80], 80);
-		if (res != 0)
+	if (prepareKeyHalf(keydata, 80, CHECKSUM_UNFIXED, &out->data) == 0) {
+		if (prepareKeyHalf(&keydata[80], 80, CHECKSUM_LOCKED, &out->tag) != 0)
 			return -2;
 	} else {
-		res = amitool_setKeysUnfixed(&keydata[80], 80);
-		if (res != 0)
+		if (prepareKeyHalf(&keydata[80], 80, CHECKSUM_UNFIXED, &out->data) != 0)
 			return -2;
-		int res = amitool_setKeysFixed(keydata, 80);
-		if (res != 0)
+		if (prepareKeyHalf(keydata, 80, CHECKSUM_LOCKED, &out->tag) != 0)
 			return -2;
 	}
 	return 0;
 }
 
-int amitool_setKeysUnfixed(uint8_t* keydata, int len) {
-	if (sizeof(keys.data) != len)
-		return -2;
-	
-	uint8_t checksum[32]; 
-	mbedtls_sha256(keydata, len, checksum, 0);
-	
-	if (memcmp(CHECKSUM_UNFIXED, checksum, sizeof(checksum)))
-		return -2;
-	
+int amitool_setKeys(uint8_t* keydata, int len) {
+	nfc3d_amiibo_preparedkeys prepared;
+	int res = amitool_prepareKeys(keydata, len, &prepared);
+	if (res != 0)
+		return res;
 	
-	memcpy(&keys.data, keydata, len);
+	keys = prepared; //only replace the loaded keys once both halves checked out
 	return 0;
 }
 
+int amitool_setKeysUnfixed(uint8_t* keydata, int len) {
+	return prepareKeyHalf(keydata, len, CHECKSUM_UNFIXED, &keys.data);
+}
+
 int amitool_setKeysFixed(uint8_t* keydata, int len) {
-	if (sizeof(keys.tag) != len)
+	if (sizeof(keys.tag.keys) != len)
 		return -1;
 	
-	uint8_t checksum[32]; 
-	mbedtls_sha256(keydata, len, checksum, 0);
-	
-	if (memcmp(CHECKSUM_LOCKED, checksum, sizeof(checksum)))
-		return -2;
-
-	memcpy(&keys.tag, keydata, len);
-	return 0;
+	return prepareKeyHalf(keydata, len, CHECKSUM_LOCKED, &keys.tag);
 }
 
 int amitool_unpack(uint8_t* tag, int taglen, uint8_t* rdata, int rdatalen) {
 	if (taglen< NFC3D_AMIIBO_SIZE || rdatalen< NFC3D_AMIIBO_SIZE || rdatalen < taglen )
 		return 0;
 	
-	memcpy(rdata, tag, taglen); //copy any extra data in source to destination
+	copyExtra(tag, taglen, rdata); //copy any extra data in source to destination
 	if (!nfc3d_amiibo_unpack(&keys, tag, rdata))
 		return 0;
 	
 	return 1;
 }
 
+int amitool_verify(uint8_t* tag, int taglen) {
+	if (taglen < NFC3D_AMIIBO_SIZE)
+		return 0;
+	
+	return nfc3d_amiibo_verify(&keys, tag) ? 1 : 0;
+}
+
+int amitool_unpackSession(uint8_t* tag, int taglen, uint8_t* rdata, int rdatalen, nfc3d_amiibo_session* session) {
+	return amitool_unpackSessionWith(&keys, tag, taglen, rdata, rdatalen, session);
+}
+
+int amitool_unpackSessionWith(const nfc3d_amiibo_preparedkeys* amiiboKeys, uint8_t* tag, int taglen, uint8_t* rdata, int rdatalen, nfc3d_amiibo_session* session) {
+	if (taglen< NFC3D_AMIIBO_SIZE || rdatalen< NFC3D_AMIIBO_SIZE || rdatalen < taglen )
+		return 0;
+	
+	copyExtra(tag, taglen, rdata); //copy any extra data in source to destination
+	if (!nfc3d_amiibo_unpack_session(amiiboKeys, tag, rdata, session))
+		return 0;
+	
+	return 1;
+}
+
 int amitool_pack(uint8_t* tag, int taglen, uint8_t* rdata, int rdatalen) {
 	if (taglen< NFC3D_AMIIBO_SIZE || rdatalen< NFC3D_AMIIBO_SIZE || rdatalen < taglen)
 		return 0;
 	
-	memcpy(rdata, tag, taglen); //copy any extra data in source to destination
+	copyExtra(tag, taglen, rdata); //copy any extra data in source to destination
 	nfc3d_amiibo_pack(&keys, tag, rdata);
 	
 	return 1;
 }
 
+int amitool_packSession(uint8_t* tag, int taglen, uint8_t* rdata, int rdatalen, nfc3d_amiibo_session* session) {
+	return amitool_packSessionWith(&keys, tag, taglen, rdata, rdatalen, session);
+}
+
+int amitool_packSessionWith(const nfc3d_amiibo_preparedkeys* amiiboKeys, uint8_t* tag, int taglen, uint8_t* rdata, int rdatalen, nfc3d_amiibo_session* session) {
+	if (taglen< NFC3D_AMIIBO_SIZE || rdatalen< NFC3D_AMIIBO_SIZE || rdatalen < taglen)
+		return 0;
+	
+	copyExtra(tag, taglen, rdata); //copy any extra data in source to destination
+	nfc3d_amiibo_pack_session(amiiboKeys, session, tag, rdata);
+	
+	return 1;
+}
+
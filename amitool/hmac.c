@@ -0,0 +1,247 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "nfc3d/hmac.h"
+#include <assert.h>
+#include <string.h>
+
+static void nfc3d_hmac_sha256_absorb_pad(mbedtls_sha256_context * sha, const uint8_t * hmacKey, size_t hmacKeySize, uint8_t padByte) {
+	uint8_t pad[NFC3D_HMAC_SHA256_BLOCK_SIZE];
+	size_t i;
+
+	memset(pad, padByte, sizeof(pad));
+	for (i = 0; i < hmacKeySize; i++) {
+		pad[i] ^= hmacKey[i];
+	}
+
+	mbedtls_sha256_init(sha);
+	mbedtls_sha256_starts(sha, 0);
+	mbedtls_sha256_update(sha, pad, sizeof(pad));
+
+	memset(pad, 0, sizeof(pad));
+}
+
+void nfc3d_hmac_sha256_setkey(nfc3d_hmac_sha256_key * key, const uint8_t * hmacKey, size_t hmacKeySize) {
+	uint8_t hashedKey[NFC3D_HMAC_SHA256_OUTPUT_SIZE];
+
+	assert(key != NULL);
+	assert(hmacKey != NULL);
+
+	// Keys longer than a block are hashed first, as per RFC 2104
+	if (hmacKeySize > NFC3D_HMAC_SHA256_BLOCK_SIZE) {
+		mbedtls_sha256(hmacKey, hmacKeySize, hashedKey, 0);
+		hmacKey = hashedKey;
+		hmacKeySize = sizeof(hashedKey);
+	}
+
+	// The ipad/opad blocks only depend on the key, so they are hashed once here
+	// and every HMAC using this key just resumes from these states
+	nfc3d_hmac_sha256_absorb_pad(&key->inner, hmacKey, hmacKeySize, 0x36);
+	nfc3d_hmac_sha256_absorb_pad(&key->outer, hmacKey, hmacKeySize, 0x5C);
+
+	memset(hashedKey, 0, sizeof(hashedKey));
+}
+
+void nfc3d_hmac_sha256_key_cleanup(nfc3d_hmac_sha256_key * key) {
+	assert(key != NULL);
+	mbedtls_sha256_free(&key->inner);
+	mbedtls_sha256_free(&key->outer);
+}
+
+void nfc3d_hmac_sha256_starts(nfc3d_hmac_sha256_ctx * ctx, const nfc3d_hmac_sha256_key * key) {
+	assert(ctx != NULL);
+	assert(key != NULL);
+
+	mbedtls_sha256_clone(&ctx->sha, &key->inner);
+	ctx->key = key;
+}
+
+void nfc3d_hmac_sha256_update(nfc3d_hmac_sha256_ctx * ctx, const uint8_t * input, size_t inputSize) {
+	assert(ctx != NULL);
+	mbedtls_sha256_update(&ctx->sha, input, inputSize);
+}
+
+void nfc3d_hmac_sha256_finish(nfc3d_hmac_sha256_ctx * ctx, uint8_t * output) {
+	uint8_t innerHash[NFC3D_HMAC_SHA256_OUTPUT_SIZE];
+
+	assert(ctx != NULL);
+	assert(output != NULL);
+
+	mbedtls_sha256_finish(&ctx->sha, innerHash);
+
+	mbedtls_sha256_clone(&ctx->sha, &ctx->key->outer);
+	mbedtls_sha256_update(&ctx->sha, innerHash, sizeof(innerHash));
+	mbedtls_sha256_finish(&ctx->sha, output);
+
+	mbedtls_sha256_free(&ctx->sha);
+	memset(innerHash, 0, sizeof(innerHash));
+}
+
+void nfc3d_hmac_sha256_keyed(const nfc3d_hmac_sha256_key * key, const uint8_t * input, size_t inputSize, uint8_t * output) {
+	nfc3d_hmac_sha256_ctx ctx;
+
+	nfc3d_hmac_sha256_starts(&ctx, key);
+	nfc3d_hmac_sha256_update(&ctx, input, inputSize);
+	nfc3d_hmac_sha256_finish(&ctx, output);
+}
+
+/*
+ * Multi-lane helpers. States are word-major, state[word * lanes + lane].
+ */
+#define NFC3D_HMAC_SHA256_MAX_LANES NFC3D_SHA256X8_LANES
+
+typedef void (*nfc3d_sha256x_process_fn)(uint32_t * state, const uint8_t * const * blocks);
+
+static void nfc3d_hmac_sha256_process_x4(uint32_t * state, const uint8_t * const * blocks) {
+	nfc3d_sha256x4_process((uint32_t (*)[NFC3D_SHA256X4_LANES]) state, blocks);
+}
+
+static void nfc3d_hmac_sha256_process_x8(uint32_t * state, const uint8_t * const * blocks) {
+	nfc3d_sha256x8_process((uint32_t (*)[NFC3D_SHA256X8_LANES]) state, blocks);
+}
+
+/*
+ * Hashes inputSize more bytes on every lane (all lanes having already absorbed
+ * exactly one block) and writes out the final digests.
+ */
+static void nfc3d_hmac_sha256_lanes_finish(unsigned int lanes, nfc3d_sha256x_process_fn process, uint32_t * state, const uint8_t * const * inputs, size_t inputSize, uint8_t * const * outputs) {
+	uint8_t tail[NFC3D_HMAC_SHA256_MAX_LANES][2 * NFC3D_HMAC_SHA256_BLOCK_SIZE];
+	const uint8_t * blocks[NFC3D_HMAC_SHA256_MAX_LANES];
+	uint64_t totalBits = ((uint64_t) NFC3D_HMAC_SHA256_BLOCK_SIZE + inputSize) * 8;
+	size_t fullSize = inputSize & ~(size_t) (NFC3D_HMAC_SHA256_BLOCK_SIZE - 1);
+	size_t tailSize = inputSize - fullSize;
+	size_t padSize = tailSize < 56 ? NFC3D_HMAC_SHA256_BLOCK_SIZE : 2 * NFC3D_HMAC_SHA256_BLOCK_SIZE;
+	size_t pos;
+	unsigned int lane, i;
+
+	assert(lanes <= NFC3D_HMAC_SHA256_MAX_LANES);
+
+	for (pos = 0; pos < fullSize; pos += NFC3D_HMAC_SHA256_BLOCK_SIZE) {
+		for (lane = 0; lane < lanes; lane++) {
+			blocks[lane] = inputs[lane] + pos;
+		}
+		process(state, blocks);
+	}
+
+	// Every lane has the same length, so they all share the same padding layout
+	for (lane = 0; lane < lanes; lane++) {
+		memcpy(tail[lane], inputs[lane] + fullSize, tailSize);
+		memset(tail[lane] + tailSize, 0, padSize - tailSize);
+		tail[lane][tailSize] = 0x80;
+		for (i = 0; i < 8; i++) {
+			tail[lane][padSize - 1 - i] = (uint8_t) (totalBits >> (8 * i));
+		}
+	}
+
+	for (pos = 0; pos < padSize; pos += NFC3D_HMAC_SHA256_BLOCK_SIZE) {
+		for (lane = 0; lane < lanes; lane++) {
+			blocks[lane] = tail[lane] + pos;
+		}
+		process(state, blocks);
+	}
+
+	for (lane = 0; lane < lanes; lane++) {
+		for (i = 0; i < 8; i++) {
+			uint32_t word = state[i * lanes + lane];
+			outputs[lane][4 * i + 0] = (uint8_t) (word >> 24);
+			outputs[lane][4 * i + 1] = (uint8_t) (word >> 16);
+			outputs[lane][4 * i + 2] = (uint8_t) (word >> 8);
+			outputs[lane][4 * i + 3] = (uint8_t) (word);
+		}
+	}
+
+	memset(tail, 0, sizeof(tail));
+}
+
+static void nfc3d_hmac_sha256_lanes(unsigned int lanes, nfc3d_sha256x_process_fn process, const nfc3d_hmac_sha256_key * const * keys, const uint8_t * const * inputs, size_t inputSize, uint8_t * const * outputs) {
+	uint32_t state[8 * NFC3D_HMAC_SHA256_MAX_LANES];
+	uint8_t innerHash[NFC3D_HMAC_SHA256_MAX_LANES][NFC3D_HMAC_SHA256_OUTPUT_SIZE];
+	const uint8_t * innerInputs[NFC3D_HMAC_SHA256_MAX_LANES];
+	uint8_t * innerOutputs[NFC3D_HMAC_SHA256_MAX_LANES];
+	unsigned int lane, i;
+
+	// Inner hash, resuming from each key's ipad state
+	for (lane = 0; lane < lanes; lane++) {
+		assert(keys[lane]->inner.total[0] == NFC3D_HMAC_SHA256_BLOCK_SIZE);
+		for (i = 0; i < 8; i++) {
+			state[i * lanes + lane] = keys[lane]->inner.state[i];
+		}
+		innerInputs[lane] = innerHash[lane];
+		innerOutputs[lane] = innerHash[lane];
+	}
+	nfc3d_hmac_sha256_lanes_finish(lanes, process, state, inputs, inputSize, innerOutputs);
+
+	// Outer hash, resuming from each key's opad state
+	for (lane = 0; lane < lanes; lane++) {
+		for (i = 0; i < 8; i++) {
+			state[i * lanes + lane] = keys[lane]->outer.state[i];
+		}
+	}
+	nfc3d_hmac_sha256_lanes_finish(lanes, process, state, innerInputs, NFC3D_HMAC_SHA256_OUTPUT_SIZE, outputs);
+
+	memset(innerHash, 0, sizeof(innerHash));
+}
+
+void nfc3d_hmac_sha256_x4(const nfc3d_hmac_sha256_key * const keys[NFC3D_SHA256X4_LANES], const uint8_t * const inputs[NFC3D_SHA256X4_LANES], size_t inputSize, uint8_t * const outputs[NFC3D_SHA256X4_LANES]) {
+	nfc3d_hmac_sha256_lanes(NFC3D_SHA256X4_LANES, nfc3d_hmac_sha256_process_x4, keys, inputs, inputSize, outputs);
+}
+
+void nfc3d_hmac_sha256_x8(const nfc3d_hmac_sha256_key * const keys[NFC3D_SHA256X8_LANES], const uint8_t * const inputs[NFC3D_SHA256X8_LANES], size_t inputSize, uint8_t * const outputs[NFC3D_SHA256X8_LANES]) {
+	nfc3d_hmac_sha256_lanes(NFC3D_SHA256X8_LANES, nfc3d_hmac_sha256_process_x8, keys, inputs, inputSize, outputs);
+}
+
+/*
+ * Eight setkeys at once; keys must fit in one block
+ */
+void nfc3d_hmac_sha256_setkey_x8(nfc3d_hmac_sha256_key * const keys[NFC3D_SHA256X8_LANES], const uint8_t * const hmacKeys[NFC3D_SHA256X8_LANES], size_t hmacKeySize) {
+	static const uint8_t padBytes[2] = { 0x36, 0x5C };
+	uint32_t state[8][NFC3D_SHA256X8_LANES];
+	uint8_t pads[NFC3D_SHA256X8_LANES][NFC3D_HMAC_SHA256_BLOCK_SIZE];
+	const uint8_t * blocks[NFC3D_SHA256X8_LANES];
+	mbedtls_sha256_context iv;
+	unsigned int pad, lane, i;
+
+	assert(hmacKeySize <= NFC3D_HMAC_SHA256_BLOCK_SIZE);
+
+	mbedtls_sha256_init(&iv);
+	mbedtls_sha256_starts(&iv, 0);
+
+	for (pad = 0; pad < sizeof(padBytes); pad++) {
+		for (lane = 0; lane < NFC3D_SHA256X8_LANES; lane++) {
+			memset(pads[lane], padBytes[pad], sizeof(pads[lane]));
+			for (i = 0; i < hmacKeySize; i++) {
+				pads[lane][i] ^= hmacKeys[lane][i];
+			}
+			blocks[lane] = pads[lane];
+		}
+
+		for (i = 0; i < 8; i++) {
+			for (lane = 0; lane < NFC3D_SHA256X8_LANES; lane++) {
+				state[i][lane] = iv.state[i];
+			}
+		}
+		nfc3d_sha256x8_process(state, blocks);
+
+		// Leave each context exactly as a one-block mbedtls_sha256_update would
+		for (lane = 0; lane < NFC3D_SHA256X8_LANES; lane++) {
+			mbedtls_sha256_context * sha = pad == 0 ? &keys[lane]->inner : &keys[lane]->outer;
+			mbedtls_sha256_clone(sha, &iv);
+			sha->total[0] = NFC3D_HMAC_SHA256_BLOCK_SIZE;
+			for (i = 0; i < 8; i++) {
+				sha->state[i] = state[i][lane];
+			}
+		}
+	}
+
+	mbedtls_sha256_free(&iv);
+	memset(pads, 0, sizeof(pads));
+}
+
+void nfc3d_hmac_sha256(const uint8_t * hmacKey, size_t hmacKeySize, const uint8_t * input, size_t inputSize, uint8_t * output) {
+	nfc3d_hmac_sha256_key key;
+
+	nfc3d_hmac_sha256_setkey(&key, hmacKey, hmacKeySize);
+	nfc3d_hmac_sha256_keyed(&key, input, inputSize, output);
+	nfc3d_hmac_sha256_key_cleanup(&key);
+}
@@ -258,6 +258,13 @@ void mbedtls_aes_encrypt( mbedtls_aes_context *ctx,
                           const unsigned char input[16],
                           unsigned char output[16] );
 
+#if defined(MBEDTLS_AES_ENCRYPT_ALT)
+/* Table-based block encryption, reference for the MBEDTLS_AES_ENCRYPT_ALT backends */
+void mbedtls_aes_encrypt_c( mbedtls_aes_context *ctx,
+                            const unsigned char input[16],
+                            unsigned char output[16] );
+#endif
+
 /**
  * \brief           Internal AES block decryption function
  *                  (Only exposed to allow overriding it,
@@ -38,6 +38,17 @@
 /* mbed TLS feature support */
 #define MBEDTLS_CIPHER_MODE_CTR
 
+/* SHA-256 compression is dispatched at runtime by amitool/sha256_backend.c */
+#define MBEDTLS_SHA256_PROCESS_ALT
+
+/* AES block encryption is dispatched at runtime by amitool/aes_backend.c */
+#define MBEDTLS_AES_ENCRYPT_ALT
+
+/* Known answer tests, run by the backend self tests in CRYPTO_SELF_TEST builds */
+#if defined(CRYPTO_SELF_TEST)
+#define MBEDTLS_SELF_TEST
+#endif
+
 /* mbed TLS modules */
 #define MBEDTLS_AES_C
 #define MBEDTLS_MD_C
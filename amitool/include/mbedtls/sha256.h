@@ -104,6 +104,11 @@ void mbedtls_sha256_finish( mbedtls_sha256_context *ctx, unsigned char output[32
 /* Internal use */
 void mbedtls_sha256_process( mbedtls_sha256_context *ctx, const unsigned char data[64] );
 
+#if defined(MBEDTLS_SHA256_PROCESS_ALT)
+/* Portable compression function, reference for the MBEDTLS_SHA256_PROCESS_ALT backends */
+void mbedtls_sha256_process_c( mbedtls_sha256_context *ctx, const unsigned char data[64] );
+#endif
+
 #ifdef __cplusplus
 }
 #endif
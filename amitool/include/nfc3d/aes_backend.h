@@ -0,0 +1,40 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef HAVE_NFC3D_AES_BACKEND_H
+#define HAVE_NFC3D_AES_BACKEND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "mbedtls/aes.h"
+
+#define NFC3D_AES_BLOCK_SIZE	16
+#define NFC3D_AES_MAX_STREAMS	4	/* Keystreams interleaved per backend call */
+
+/*
+ * Implementations of mbedtls_aes_encrypt (MBEDTLS_AES_ENCRYPT_ALT) plus a
+ * multi-block CTR keystream path. The fastest one the CPU supports is picked
+ * on first use, after being cross-checked against the table-based reference.
+ */
+typedef enum {
+	NFC3D_AES_BACKEND_C = 0,	/* mbedtls T-tables */
+	NFC3D_AES_BACKEND_ARMV6,	/* ARM11: single rotated T-table, word loads */
+	NFC3D_AES_BACKEND_AESNI,	/* x86-64 AES-NI */
+	NFC3D_AES_BACKEND_ARMV8,	/* AArch64 crypto extensions */
+	NFC3D_AES_BACKEND_COUNT
+} nfc3d_aes_backend;
+
+const char * nfc3d_aes_backend_name(nfc3d_aes_backend backend);
+bool nfc3d_aes_backend_available(nfc3d_aes_backend backend);
+bool nfc3d_aes_backend_select(nfc3d_aes_backend backend);
+nfc3d_aes_backend nfc3d_aes_backend_current(void);
+int nfc3d_aes_backend_self_test(int verbose);
+
+void nfc3d_aes_ctr_keystream(const mbedtls_aes_context * aes, const uint8_t * iv, uint8_t * keystream, size_t blocks);
+void nfc3d_aes_ctr_keystream_many(const mbedtls_aes_context * const * aes, const uint8_t * const * ivs, uint8_t * const * keystreams, size_t blocks, size_t count);
+void nfc3d_aes_ctr_xor(const mbedtls_aes_context * aes, const uint8_t * iv, const uint8_t * input, uint8_t * output, size_t size);
+void nfc3d_aes_xor(const uint8_t * input, const uint8_t * keystream, uint8_t * output, size_t size);
+
+#endif
@@ -10,9 +10,19 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "keygen.h"
+#include "layout.h"
 
 #define NFC3D_AMIIBO_SIZE 520
+#define NFC3D_AMIIBO_KEYSTREAM_SIZE 0x190 // 25 AES blocks over the 0x188 encrypted bytes
+#define NFC3D_AMIIBO_UID7_SIZE 7
+#define NFC3D_AMIIBO_UID9_SIZE 9 // UID with both BCC bytes, as stored on the tag
+
+// Derived keysets remembered per thread, see nfc3d_amiibo_keycache_stats
+#ifndef NFC3D_AMIIBO_KEYCACHE_SIZE
+#define NFC3D_AMIIBO_KEYCACHE_SIZE 8
+#endif
 
 #pragma pack(1)
 typedef struct {
@@ -21,8 +31,47 @@ typedef struct {
 } nfc3d_amiibo_keys;
 #pragma pack()
 
-bool nfc3d_amiibo_unpack(const nfc3d_amiibo_keys * amiiboKeys, const uint8_t * tag, uint8_t * plain);
-void nfc3d_amiibo_pack(const nfc3d_amiibo_keys * amiiboKeys, const uint8_t * plain, uint8_t * tag);
+typedef struct nfc3d_amiibo_preparedkeys {
+	nfc3d_keygen_preparedkeys data;
+	nfc3d_keygen_preparedkeys tag;
+} nfc3d_amiibo_preparedkeys;
+
+/*
+ * What an unpack leaves behind so packing the same dump again (same seed, so
+ * same keys) only re-encrypts the bytes that changed and redoes the HMACs
+ */
+typedef struct nfc3d_amiibo_session {
+	uint8_t seed[NFC3D_KEYGEN_SEED_SIZE];
+	nfc3d_hmac_sha256_key dataHmacKey;
+	nfc3d_hmac_sha256_key tagHmacKey;
+	uint8_t keystream[NFC3D_AMIIBO_KEYSTREAM_SIZE];
+	uint8_t plain[NFC3D_AMIIBO_SIZE];	// Plaintext that internal was produced from
+	uint8_t internal[NFC3D_AMIIBO_SIZE];	// Encrypted, internal layout
+	bool valid;
+} nfc3d_amiibo_session;
+
+void nfc3d_amiibo_prepare_keys(const nfc3d_amiibo_keys * amiiboKeys, nfc3d_amiibo_preparedkeys * preparedKeys);
+size_t nfc3d_amiibo_tag_offset(size_t internalOffset);
+void nfc3d_amiibo_tag_to_internal(const uint8_t * tag, uint8_t * intl);
+void nfc3d_amiibo_internal_to_tag(const uint8_t * intl, uint8_t * tag);
+void nfc3d_amiibo_tag_to_internal_inplace(uint8_t * dump);
+void nfc3d_amiibo_internal_to_tag_inplace(uint8_t * dump);
+void nfc3d_amiibo_keygen_both(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * dump, nfc3d_keygen_derivedkeys * dataKeys, nfc3d_keygen_derivedkeys * tagKeys);
+void nfc3d_amiibo_keycache_clear(void);
+void nfc3d_amiibo_keycache_stats(uint32_t * hits, uint32_t * misses); // Calling thread's counters
+void nfc3d_amiibo_cipher(const nfc3d_keygen_derivedkeys * keys, const uint8_t * in, uint8_t * out);
+bool nfc3d_amiibo_unpack(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * tag, uint8_t * plain);
+void nfc3d_amiibo_unpack_many(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * const * tags, uint8_t * const * plains, bool * results, size_t count);
+bool nfc3d_amiibo_verify(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * tag);
+void nfc3d_amiibo_pack(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * plain, uint8_t * tag);
+void nfc3d_amiibo_session_begin(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * tagHead, nfc3d_amiibo_session * session);
+bool nfc3d_amiibo_session_finish(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * tag, uint8_t * plain, nfc3d_amiibo_session * session);
+bool nfc3d_amiibo_unpack_session(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * tag, uint8_t * plain, nfc3d_amiibo_session * session);
+void nfc3d_amiibo_pack_session(const nfc3d_amiibo_preparedkeys * amiiboKeys, nfc3d_amiibo_session * session, const uint8_t * plain, uint8_t * tag);
+void nfc3d_amiibo_session_cleanup(nfc3d_amiibo_session * session);
+void nfc3d_amiibo_uid7_to_uid9(const uint8_t * uid7, uint8_t * uid9);
+void nfc3d_amiibo_set_uid(uint8_t * plain, const uint8_t * uid9);
+void nfc3d_amiibo_pack_uids(const nfc3d_amiibo_preparedkeys * amiiboKeys, const uint8_t * plain, const uint8_t * const * uids, uint8_t * const * tags, size_t count);
 bool nfc3d_amiibo_load_keys(nfc3d_amiibo_keys * amiiboKeys, const char * path);
 
 #endif
@@ -3,10 +3,19 @@
 
 #define AMIIBO_MAX_SIZE 572 
 
+struct nfc3d_amiibo_session;
+struct nfc3d_amiibo_preparedkeys;
+
 int amitool_setKeys(uint8_t* keydata, int len);
+int amitool_prepareKeys(uint8_t* keydata, int len, struct nfc3d_amiibo_preparedkeys* out); //checks and prepares a key file without touching the loaded keys
 int amitool_setKeysUnfixed(uint8_t* keydata, int len);
 int amitool_setKeysFixed(uint8_t* keydata, int len);
 int amitool_unpack(uint8_t* tag, int taglen, uint8_t* rdata, int rdatalen);
+int amitool_verify(uint8_t* tag, int taglen); //checks both HMACs without producing plaintext
 int amitool_pack(uint8_t* tag, int taglen, uint8_t* rdata, int rdatalen);
+int amitool_unpackSession(uint8_t* tag, int taglen, uint8_t* rdata, int rdatalen, struct nfc3d_amiibo_session* session); //keeps keys and keystream for amitool_packSession
+int amitool_packSession(uint8_t* tag, int taglen, uint8_t* rdata, int rdatalen, struct nfc3d_amiibo_session* session); //same output as amitool_pack, skips keygen/AES while the UID is unchanged
+int amitool_unpackSessionWith(const struct nfc3d_amiibo_preparedkeys* keys, uint8_t* tag, int taglen, uint8_t* rdata, int rdatalen, struct nfc3d_amiibo_session* session);
+int amitool_packSessionWith(const struct nfc3d_amiibo_preparedkeys* keys, uint8_t* tag, int taglen, uint8_t* rdata, int rdatalen, struct nfc3d_amiibo_session* session);
 
 #endif
\ No newline at end of file
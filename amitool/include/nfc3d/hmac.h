@@ -0,0 +1,39 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef HAVE_NFC3D_HMAC_H
+#define HAVE_NFC3D_HMAC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "mbedtls/sha256.h"
+#include "sha256x.h"
+
+#define NFC3D_HMAC_SHA256_BLOCK_SIZE	64
+#define NFC3D_HMAC_SHA256_OUTPUT_SIZE	32
+
+/* SHA-256 states after absorbing the HMAC key XOR'd with ipad and opad */
+typedef struct {
+	mbedtls_sha256_context inner;
+	mbedtls_sha256_context outer;
+} nfc3d_hmac_sha256_key;
+
+/* A running HMAC. It only borrows the key, which must outlive the context. */
+typedef struct {
+	mbedtls_sha256_context sha;
+	const nfc3d_hmac_sha256_key * key;
+} nfc3d_hmac_sha256_ctx;
+
+void nfc3d_hmac_sha256_setkey(nfc3d_hmac_sha256_key * key, const uint8_t * hmacKey, size_t hmacKeySize);
+void nfc3d_hmac_sha256_key_cleanup(nfc3d_hmac_sha256_key * key);
+void nfc3d_hmac_sha256_starts(nfc3d_hmac_sha256_ctx * ctx, const nfc3d_hmac_sha256_key * key);
+void nfc3d_hmac_sha256_update(nfc3d_hmac_sha256_ctx * ctx, const uint8_t * input, size_t inputSize);
+void nfc3d_hmac_sha256_finish(nfc3d_hmac_sha256_ctx * ctx, uint8_t * output);
+void nfc3d_hmac_sha256_keyed(const nfc3d_hmac_sha256_key * key, const uint8_t * input, size_t inputSize, uint8_t * output);
+void nfc3d_hmac_sha256_setkey_x8(nfc3d_hmac_sha256_key * const keys[NFC3D_SHA256X8_LANES], const uint8_t * const hmacKeys[NFC3D_SHA256X8_LANES], size_t hmacKeySize);
+void nfc3d_hmac_sha256_x4(const nfc3d_hmac_sha256_key * const keys[NFC3D_SHA256X4_LANES], const uint8_t * const inputs[NFC3D_SHA256X4_LANES], size_t inputSize, uint8_t * const outputs[NFC3D_SHA256X4_LANES]);
+void nfc3d_hmac_sha256_x8(const nfc3d_hmac_sha256_key * const keys[NFC3D_SHA256X8_LANES], const uint8_t * const inputs[NFC3D_SHA256X8_LANES], size_t inputSize, uint8_t * const outputs[NFC3D_SHA256X8_LANES]);
+void nfc3d_hmac_sha256(const uint8_t * hmacKey, size_t hmacKeySize, const uint8_t * input, size_t inputSize, uint8_t * output);
+
+#endif
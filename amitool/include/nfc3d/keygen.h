@@ -9,8 +9,10 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "drbg.h"
 
 #define NFC3D_KEYGEN_SEED_SIZE 64
+#define NFC3D_KEYGEN_DIGEST_SIZE 32
 
 #pragma pack(1)
 typedef struct {
@@ -29,6 +31,15 @@ typedef struct {
 } nfc3d_keygen_derivedkeys;
 #pragma pack()
 
-void nfc3d_keygen(const nfc3d_keygen_masterkeys * baseKeys, const uint8_t * baseSeed, nfc3d_keygen_derivedkeys * derivedKeys);
+typedef struct {
+	nfc3d_keygen_masterkeys keys;
+	nfc3d_hmac_sha256_key hmacKey;
+	uint8_t digest[NFC3D_KEYGEN_DIGEST_SIZE]; // SHA-256 of keys, tells key sets apart without another copy of them
+} nfc3d_keygen_preparedkeys;
+
+void nfc3d_keygen_prepare_keys(const nfc3d_keygen_masterkeys * baseKeys, nfc3d_keygen_preparedkeys * preparedKeys);
+void nfc3d_keygen(const nfc3d_keygen_preparedkeys * baseKeys, const uint8_t * baseSeed, nfc3d_keygen_derivedkeys * derivedKeys);
+void nfc3d_keygen_x8(const nfc3d_keygen_preparedkeys * baseKeys, const uint8_t * const baseSeeds[NFC3D_SHA256X8_LANES], nfc3d_keygen_derivedkeys * const derivedKeys[NFC3D_SHA256X8_LANES]);
+void nfc3d_keygen_pair(const nfc3d_keygen_preparedkeys * baseKeysA, const nfc3d_keygen_preparedkeys * baseKeysB, const uint8_t * baseSeed, nfc3d_keygen_derivedkeys * derivedKeysA, nfc3d_keygen_derivedkeys * derivedKeysB);
 
 #endif
@@ -0,0 +1,183 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef HAVE_NFC3D_LAYOUT_H
+#define HAVE_NFC3D_LAYOUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The amiibo dump layout, described once. Offsets, accessors, the signature
+ * check and the tag<->internal permutation are all expanded from the lists
+ * below at compile time, so with constant offsets they fold into direct loads.
+ *
+ * Dumps come in two layouts: "tag" is the NTAG215 page order, as read from
+ * and written to the figure, and "internal" is the order the crypto works on.
+ */
+
+/*
+ * X(arg, internal, tag, size): where each run of the internal layout sits in
+ * the tag layout, in internal order. Together they cover the first 520 bytes;
+ * anything past that (lock and config pages, password) is at the same offset
+ * in both layouts.
+ */
+#define NFC3D_AMIIBO_SPANS(X, arg) \
+	X(arg, 0x000, 0x008, 0x008) \
+	X(arg, 0x008, 0x080, 0x020) \
+	X(arg, 0x028, 0x010, 0x024) \
+	X(arg, 0x04C, 0x0A0, 0x168) \
+	X(arg, 0x1B4, 0x034, 0x020) \
+	X(arg, 0x1D4, 0x000, 0x008) \
+	X(arg, 0x1DC, 0x054, 0x02C)
+
+#define NFC3D_AMIIBO_SPAN_TO_TAG(off, intl, tag, size) ((size_t) (off) - (intl) < (size)) ? (size_t) (tag) + ((off) - (intl)) :
+#define NFC3D_AMIIBO_SPAN_TO_INTERNAL(off, intl, tag, size) ((size_t) (off) - (tag) < (size)) ? (size_t) (intl) + ((off) - (tag)) :
+#define NFC3D_AMIIBO_SPAN_END(off, intl, tag, size) ((size_t) (off) - (intl) < (size)) ? (size_t) (intl) + (size) :
+
+// Offset conversions, constant expressions for constant offsets
+#define NFC3D_AMIIBO_TAG_OFFSET(internalOffset) (NFC3D_AMIIBO_SPANS(NFC3D_AMIIBO_SPAN_TO_TAG, internalOffset) (size_t) (internalOffset))
+#define NFC3D_AMIIBO_INTERNAL_OFFSET(tagOffset) (NFC3D_AMIIBO_SPANS(NFC3D_AMIIBO_SPAN_TO_INTERNAL, tagOffset) (size_t) (tagOffset))
+
+// Internal offset where the span holding internalOffset ends
+#define NFC3D_AMIIBO_SPAN_END_OF(internalOffset) (NFC3D_AMIIBO_SPANS(NFC3D_AMIIBO_SPAN_END, internalOffset) (size_t) (internalOffset) + 1)
+
+/*
+ * X(NAME, name, internal, size): named fields, by internal offset. Each one
+ * sits within a single span, so it is contiguous in both layouts.
+ */
+#define NFC3D_AMIIBO_FIELDS(X) \
+	X(BCC1,          bcc1,          0x000, 0x001) /* Second UID check byte */ \
+	X(STATIC_LOCK,   static_lock,   0x002, 0x002) \
+	X(CAPABILITY,    capability,    0x004, 0x004) /* NDEF capability container */ \
+	X(DATA_HMAC,     data_hmac,     0x008, 0x020) \
+	X(WRITE_COUNTER, write_counter, 0x029, 0x002) /* Big endian */ \
+	X(SETTINGS,      settings,      0x02C, 0x020) /* Flags, country, dates, CRC, nickname */ \
+	X(APP_DATA,      app_data,      0x088, 0x0D8) \
+	X(TAG_HMAC,      tag_hmac,      0x1B4, 0x020) \
+	X(UID,           uid,           0x1D4, 0x008) /* UID0-2, BCC0, UID3-6 */ \
+	X(CHAR_ID,       char_id,       0x1DC, 0x008) \
+	X(KEYGEN_SALT,   keygen_salt,   0x1E8, 0x020) \
+	X(DYNAMIC_LOCK,  dynamic_lock,  0x208, 0x004) \
+	X(CFG0,          cfg0,          0x20C, 0x004) \
+	X(CFG1,          cfg1,          0x210, 0x004) \
+	X(PWD,           pwd,           0x214, 0x004) \
+	X(PACK,          pack,          0x218, 0x002)
+
+/*
+ * X(NAME, internal, size): ranges only meaningful in the internal layout,
+ * where they are contiguous
+ */
+#define NFC3D_AMIIBO_REGIONS(X) \
+	X(ENCRYPTED,     0x02C, 0x188) /* AES-CTR with the data keys */ \
+	X(DATA_SIGNED,   0x029, 0x1DF) /* Data HMAC input */ \
+	X(TAG_SIGNED,    0x1D4, 0x034) /* Tag HMAC input */
+
+/*
+ * X(page, index, value): bytes every amiibo tag image has, in tag layout
+ */
+#define NFC3D_AMIIBO_LOCK_SIGNATURE(X) \
+	X(0x02, 2, 0x0F) X(0x02, 3, 0xE0) /* Static lock bits */
+
+// The part in the first four pages, there as soon as a read starts
+#define NFC3D_AMIIBO_HEADER_SIGNATURE(X) \
+	X(0x00, 0, 0x04) /* NXP manufacturer ID */ \
+	NFC3D_AMIIBO_LOCK_SIGNATURE(X) \
+	X(0x03, 0, 0xF1) X(0x03, 1, 0x10) X(0x03, 2, 0xFF) X(0x03, 3, 0xEE) /* Capability container */
+
+#define NFC3D_AMIIBO_SIGNATURE(X) \
+	NFC3D_AMIIBO_HEADER_SIGNATURE(X) \
+	X(0x82, 0, 0x01) X(0x82, 1, 0x00) X(0x82, 2, 0x0F) /* Dynamic lock bits */ \
+	X(0x83, 0, 0x00) X(0x83, 1, 0x00) X(0x83, 2, 0x00) X(0x83, 3, 0x04) /* CFG0 */ \
+	X(0x84, 0, 0x5F) X(0x84, 1, 0x00) X(0x84, 2, 0x00) X(0x84, 3, 0x00) /* CFG1 */
+
+#define NFC3D_AMIIBO_PAGE_SIZE 4
+#define NFC3D_AMIIBO_PAGED_BYTE(page, index) ((page) * NFC3D_AMIIBO_PAGE_SIZE + (index))
+#define NFC3D_AMIIBO_HEADER_SIGNATURE_SIZE NFC3D_AMIIBO_PAGED_BYTE(0x04, 0)
+
+/*
+ * Generated: NFC3D_AMIIBO_<NAME>_POS, _TAG_POS and _SIZE for every field, and
+ * _POS/_SIZE for every region
+ */
+#define NFC3D_AMIIBO_FIELD_CONSTANTS(NAME, name, intl, size) \
+	NFC3D_AMIIBO_##NAME##_POS = (intl), \
+	NFC3D_AMIIBO_##NAME##_TAG_POS = NFC3D_AMIIBO_TAG_OFFSET(intl), \
+	NFC3D_AMIIBO_##NAME##_SIZE = (size),
+#define NFC3D_AMIIBO_REGION_CONSTANTS(NAME, intl, size) \
+	NFC3D_AMIIBO_##NAME##_POS = (intl), \
+	NFC3D_AMIIBO_##NAME##_SIZE = (size),
+
+enum {
+	NFC3D_AMIIBO_FIELDS(NFC3D_AMIIBO_FIELD_CONSTANTS)
+	NFC3D_AMIIBO_REGIONS(NFC3D_AMIIBO_REGION_CONSTANTS)
+};
+
+// Fails to compile if a field straddles two spans
+#define NFC3D_AMIIBO_FIELD_CHECK(NAME, name, intl, size) \
+	typedef char nfc3d_amiibo_check_##name[NFC3D_AMIIBO_TAG_OFFSET((intl) + (size) - 1) - NFC3D_AMIIBO_TAG_OFFSET(intl) == (size) - 1 ? 1 : -1];
+NFC3D_AMIIBO_FIELDS(NFC3D_AMIIBO_FIELD_CHECK)
+
+/*
+ * The keygen seed (write counter, UID, keygen salt) comes from the tag layout
+ * bytes below this, so a tag being read can be keyed before the rest arrives
+ */
+#define NFC3D_AMIIBO_SEED_TAG_END (NFC3D_AMIIBO_KEYGEN_SALT_TAG_POS + NFC3D_AMIIBO_KEYGEN_SALT_SIZE)
+typedef char nfc3d_amiibo_check_seed_tag_end[
+	NFC3D_AMIIBO_WRITE_COUNTER_TAG_POS + NFC3D_AMIIBO_WRITE_COUNTER_SIZE <= NFC3D_AMIIBO_SEED_TAG_END &&
+	NFC3D_AMIIBO_UID_TAG_POS + NFC3D_AMIIBO_UID_SIZE <= NFC3D_AMIIBO_SEED_TAG_END ? 1 : -1];
+
+/*
+ * Generated: nfc3d_amiibo_intl_<name>(dump) and nfc3d_amiibo_tag_<name>(dump)
+ * return a pointer to the field in an internal or tag layout dump. Like
+ * strchr, they take const and hand back a mutable pointer.
+ */
+#define NFC3D_AMIIBO_FIELD_ACCESSORS(NAME, name, intl, size) \
+	static inline uint8_t * nfc3d_amiibo_intl_##name(const uint8_t * dump) { \
+		return (uint8_t *) dump + NFC3D_AMIIBO_##NAME##_POS; \
+	} \
+	static inline uint8_t * nfc3d_amiibo_tag_##name(const uint8_t * dump) { \
+		return (uint8_t *) dump + NFC3D_AMIIBO_##NAME##_TAG_POS; \
+	}
+NFC3D_AMIIBO_FIELDS(NFC3D_AMIIBO_FIELD_ACCESSORS)
+
+#define NFC3D_AMIIBO_SIGNATURE_BYTE(page, index, value) && dump[NFC3D_AMIIBO_PAGED_BYTE(page, index)] == (value)
+
+// Whether a tag layout dump carries the fixed bytes every amiibo has
+static inline bool nfc3d_amiibo_has_signature(const uint8_t * dump) {
+	return true NFC3D_AMIIBO_SIGNATURE(NFC3D_AMIIBO_SIGNATURE_BYTE);
+}
+
+static inline bool nfc3d_amiibo_has_header_signature(const uint8_t * dump) {
+	return true NFC3D_AMIIBO_HEADER_SIGNATURE(NFC3D_AMIIBO_SIGNATURE_BYTE);
+}
+
+static inline bool nfc3d_amiibo_has_lock_signature(const uint8_t * dump) {
+	return true NFC3D_AMIIBO_LOCK_SIGNATURE(NFC3D_AMIIBO_SIGNATURE_BYTE);
+}
+
+// Typed views over the fields that are not plain byte strings
+static inline uint16_t nfc3d_amiibo_write_counter(const uint8_t * intl) {
+	const uint8_t * counter = nfc3d_amiibo_intl_write_counter(intl);
+	return (uint16_t) ((counter[0] << 8) | counter[1]);
+}
+
+static inline void nfc3d_amiibo_set_write_counter(uint8_t * intl, uint16_t value) {
+	uint8_t * counter = nfc3d_amiibo_intl_write_counter(intl);
+	counter[0] = (uint8_t) (value >> 8);
+	counter[1] = (uint8_t) value;
+}
+
+// 7 byte UID from the UID field of either layout, without the check byte
+static inline void nfc3d_amiibo_uid_to_uid7(const uint8_t * uid, uint8_t * uid7) {
+	uid7[0] = uid[0];
+	uid7[1] = uid[1];
+	uid7[2] = uid[2];
+	uid7[3] = uid[4];
+	uid7[4] = uid[5];
+	uid7[5] = uid[6];
+	uid7[6] = uid[7];
+}
+
+#endif
@@ -0,0 +1,32 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef HAVE_NFC3D_SHA256_BACKEND_H
+#define HAVE_NFC3D_SHA256_BACKEND_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Implementations of mbedtls_sha256_process (MBEDTLS_SHA256_PROCESS_ALT).
+ * The fastest one the CPU supports is picked on first use, after being
+ * cross-checked against the portable C reference.
+ */
+typedef enum {
+	NFC3D_SHA256_BACKEND_C = 0,	/* mbedtls reference */
+	NFC3D_SHA256_BACKEND_ARMV6,	/* ARM11-scheduled C: byte-reversed word loads, rolling schedule */
+	NFC3D_SHA256_BACKEND_SHANI,	/* x86-64 SHA extensions */
+	NFC3D_SHA256_BACKEND_ARMV8,	/* AArch64 SHA2 crypto extensions */
+	NFC3D_SHA256_BACKEND_COUNT
+} nfc3d_sha256_backend;
+
+extern const uint32_t nfc3d_sha256_k[64];
+
+const char * nfc3d_sha256_backend_name(nfc3d_sha256_backend backend);
+bool nfc3d_sha256_backend_available(nfc3d_sha256_backend backend);
+bool nfc3d_sha256_backend_select(nfc3d_sha256_backend backend);
+nfc3d_sha256_backend nfc3d_sha256_backend_current(void);
+int nfc3d_sha256_backend_self_test(int verbose);
+
+#endif
@@ -0,0 +1,23 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef HAVE_NFC3D_SHA256X_H
+#define HAVE_NFC3D_SHA256X_H
+
+#include <stdint.h>
+
+#define NFC3D_SHA256X4_LANES 4
+#define NFC3D_SHA256X8_LANES 8
+
+/*
+ * Independent SHA-256 compressions run in lockstep, 4 or 8 at a time. The
+ * state is stored word-major (state[word][lane]) so every round operates on
+ * one vector: SSE2/NEON for 4 lanes, AVX2 (picked at runtime where the
+ * platform supports ifuncs) or two NEON registers for 8 lanes, and plain
+ * interleaved dependency chains on the ARM11.
+ */
+void nfc3d_sha256x4_process(uint32_t state[8][NFC3D_SHA256X4_LANES], const uint8_t * const blocks[NFC3D_SHA256X4_LANES]);
+void nfc3d_sha256x8_process(uint32_t state[8][NFC3D_SHA256X8_LANES], const uint8_t * const blocks[NFC3D_SHA256X8_LANES]);
+
+#endif
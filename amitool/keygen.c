@@ -6,6 +6,7 @@
 
 #include "nfc3d/drbg.h"
 #include "nfc3d/keygen.h"
+#include "mbedtls/sha256.h"
 #include "util.h"
 #include <assert.h>
 #include <stdio.h>
@@ -45,10 +46,117 @@ void nfc3d_keygen_prepare_seed(const nfc3d_keygen_masterkeys * baseKeys, const u
 	*outputSize = output - start;
 }
 
-void nfc3d_keygen(const nfc3d_keygen_masterkeys * baseKeys, const uint8_t * baseSeed, nfc3d_keygen_derivedkeys * derivedKeys) {
+void nfc3d_keygen_prepare_keys(const nfc3d_keygen_masterkeys * baseKeys, nfc3d_keygen_preparedkeys * preparedKeys) {
+	assert(baseKeys != NULL);
+	assert(preparedKeys != NULL);
+
+	memcpy(&preparedKeys->keys, baseKeys, sizeof(preparedKeys->keys));
+	nfc3d_hmac_sha256_setkey(&preparedKeys->hmacKey, baseKeys->hmacKey, sizeof(baseKeys->hmacKey));
+	mbedtls_sha256((const uint8_t *) baseKeys, sizeof(*baseKeys), preparedKeys->digest, 0);
+}
+
+void nfc3d_keygen(const nfc3d_keygen_preparedkeys * baseKeys, const uint8_t * baseSeed, nfc3d_keygen_derivedkeys * derivedKeys) {
 	uint8_t preparedSeed[NFC3D_DRBG_MAX_SEED_SIZE];
 	size_t preparedSeedSize;
 
-	nfc3d_keygen_prepare_seed(baseKeys, baseSeed, preparedSeed, &preparedSeedSize);
-	nfc3d_drbg_generate_bytes(baseKeys->hmacKey, sizeof(baseKeys->hmacKey), preparedSeed, preparedSeedSize, (uint8_t *) derivedKeys, sizeof(*derivedKeys));
+	nfc3d_keygen_prepare_seed(&baseKeys->keys, baseSeed, preparedSeed, &preparedSeedSize);
+	nfc3d_drbg_generate_bytes_with_key(&baseKeys->hmacKey, preparedSeed, preparedSeedSize, (uint8_t *) derivedKeys, sizeof(*derivedKeys));
+}
+
+// Every derived keyset takes two DRBG steps, so two keysets fill the four SHA-256 lanes
+#define NFC3D_KEYGEN_DRBG_STEPS ((sizeof(nfc3d_keygen_derivedkeys) + NFC3D_DRBG_OUTPUT_SIZE - 1) / NFC3D_DRBG_OUTPUT_SIZE)
+
+void nfc3d_keygen_pair(const nfc3d_keygen_preparedkeys * baseKeysA, const nfc3d_keygen_preparedkeys * baseKeysB, const uint8_t * baseSeed, nfc3d_keygen_derivedkeys * derivedKeysA, nfc3d_keygen_derivedkeys * derivedKeysB) {
+	uint8_t messages[NFC3D_SHA256X4_LANES][sizeof(uint16_t) + NFC3D_DRBG_MAX_SEED_SIZE];
+	uint8_t outputs[NFC3D_SHA256X4_LANES][NFC3D_DRBG_OUTPUT_SIZE];
+	const nfc3d_hmac_sha256_key * keys[NFC3D_SHA256X4_LANES];
+	const uint8_t * inputs[NFC3D_SHA256X4_LANES];
+	uint8_t * results[NFC3D_SHA256X4_LANES];
+	size_t seedSizeA, seedSizeB;
+	unsigned int lane;
+
+	assert(NFC3D_KEYGEN_DRBG_STEPS * 2 == NFC3D_SHA256X4_LANES);
+
+	nfc3d_keygen_prepare_seed(&baseKeysA->keys, baseSeed, messages[0] + sizeof(uint16_t), &seedSizeA);
+	nfc3d_keygen_prepare_seed(&baseKeysB->keys, baseSeed, messages[NFC3D_KEYGEN_DRBG_STEPS] + sizeof(uint16_t), &seedSizeB);
+
+	// The lanes must all hash the same amount of data. Retail keys always match,
+	// but fall back to the serial path for anything else
+	if (seedSizeA != seedSizeB) {
+		nfc3d_keygen(baseKeysA, baseSeed, derivedKeysA);
+		nfc3d_keygen(baseKeysB, baseSeed, derivedKeysB);
+		return;
+	}
+
+	for (lane = 0; lane < NFC3D_SHA256X4_LANES; lane++) {
+		unsigned int iteration = lane % NFC3D_KEYGEN_DRBG_STEPS;
+		unsigned int first = lane - iteration;
+
+		if (iteration != 0) {
+			memcpy(messages[lane] + sizeof(uint16_t), messages[first] + sizeof(uint16_t), seedSizeA);
+		}
+
+		// Same big endian counter as nfc3d_drbg_step
+		messages[lane][0] = iteration >> 8;
+		messages[lane][1] = iteration >> 0;
+
+		keys[lane] = first == 0 ? &baseKeysA->hmacKey : &baseKeysB->hmacKey;
+		inputs[lane] = messages[lane];
+		results[lane] = outputs[lane];
+	}
+
+	nfc3d_hmac_sha256_x4(keys, inputs, sizeof(uint16_t) + seedSizeA, results);
+
+	for (lane = 0; lane < NFC3D_SHA256X4_LANES; lane++) {
+		unsigned int iteration = lane % NFC3D_KEYGEN_DRBG_STEPS;
+		uint8_t * derived = (uint8_t *) (lane < NFC3D_KEYGEN_DRBG_STEPS ? derivedKeysA : derivedKeysB);
+		size_t offset = iteration * NFC3D_DRBG_OUTPUT_SIZE;
+		size_t size = sizeof(nfc3d_keygen_derivedkeys) - offset;
+
+		if (size > NFC3D_DRBG_OUTPUT_SIZE)
+			size = NFC3D_DRBG_OUTPUT_SIZE;
+		memcpy(derived + offset, outputs[lane], size);
+	}
+
+	memset(outputs, 0, sizeof(outputs));
+}
+
+void nfc3d_keygen_x8(const nfc3d_keygen_preparedkeys * baseKeys, const uint8_t * const baseSeeds[NFC3D_SHA256X8_LANES], nfc3d_keygen_derivedkeys * const derivedKeys[NFC3D_SHA256X8_LANES]) {
+	uint8_t messages[NFC3D_SHA256X8_LANES][sizeof(uint16_t) + NFC3D_DRBG_MAX_SEED_SIZE];
+	uint8_t outputs[NFC3D_SHA256X8_LANES][NFC3D_DRBG_OUTPUT_SIZE];
+	const nfc3d_hmac_sha256_key * keys[NFC3D_SHA256X8_LANES];
+	const uint8_t * inputs[NFC3D_SHA256X8_LANES];
+	uint8_t * results[NFC3D_SHA256X8_LANES];
+	size_t seedSize = 0;
+	unsigned int lane, iteration;
+
+	// The prepared seed length only depends on the master keys, so every lane matches
+	for (lane = 0; lane < NFC3D_SHA256X8_LANES; lane++) {
+		nfc3d_keygen_prepare_seed(&baseKeys->keys, baseSeeds[lane], messages[lane] + sizeof(uint16_t), &seedSize);
+		keys[lane] = &baseKeys->hmacKey;
+		inputs[lane] = messages[lane];
+		results[lane] = outputs[lane];
+	}
+
+	for (iteration = 0; iteration < NFC3D_KEYGEN_DRBG_STEPS; iteration++) {
+		size_t offset = iteration * NFC3D_DRBG_OUTPUT_SIZE;
+		size_t size = sizeof(nfc3d_keygen_derivedkeys) - offset;
+
+		if (size > NFC3D_DRBG_OUTPUT_SIZE)
+			size = NFC3D_DRBG_OUTPUT_SIZE;
+
+		// Same big endian counter as nfc3d_drbg_step
+		for (lane = 0; lane < NFC3D_SHA256X8_LANES; lane++) {
+			messages[lane][0] = iteration >> 8;
+			messages[lane][1] = iteration >> 0;
+		}
+
+		nfc3d_hmac_sha256_x8(keys, inputs, sizeof(uint16_t) + seedSize, results);
+
+		for (lane = 0; lane < NFC3D_SHA256X8_LANES; lane++) {
+			memcpy((uint8_t *) derivedKeys[lane] + offset, outputs[lane], size);
+		}
+	}
+
+	memset(outputs, 0, sizeof(outputs));
 }
@@ -130,7 +130,11 @@ void mbedtls_sha256_starts( mbedtls_sha256_context *ctx, int is224 )
     ctx->is224 = is224;
 }
 
-#if !defined(MBEDTLS_SHA256_PROCESS_ALT)
+/*
+ * The portable compression function is always built. With
+ * MBEDTLS_SHA256_PROCESS_ALT it is exported as mbedtls_sha256_process_c, the
+ * reference and fallback for the accelerated backends.
+ */
 static const uint32_t K[] =
 {
     0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5,
@@ -176,7 +180,11 @@ static const uint32_t K[] =
     d += temp1; h = temp1 + temp2;              \
 }
 
+#if defined(MBEDTLS_SHA256_PROCESS_ALT)
+void mbedtls_sha256_process_c( mbedtls_sha256_context *ctx, const unsigned char data[64] )
+#else
 void mbedtls_sha256_process( mbedtls_sha256_context *ctx, const unsigned char data[64] )
+#endif
 {
     uint32_t temp1, temp2, W[64];
     uint32_t A[8];
@@ -230,7 +238,6 @@ void mbedtls_sha256_process( mbedtls_sha256_context *ctx, const unsigned char da
     for( i = 0; i < 8; i++ )
         ctx->state[i] += A[i];
 }
-#endif /* !MBEDTLS_SHA256_PROCESS_ALT */
 
 /*
  * SHA-256 process buffer
@@ -0,0 +1,377 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "nfc3d/sha256_backend.h"
+#include "mbedtls/sha256.h"
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define NFC3D_SHA256_HAVE_SHANI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__GNUC__)
+#define NFC3D_SHA256_HAVE_ARMV8 1
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#if !defined(MBEDTLS_SHA256_PROCESS_ALT)
+#error "sha256_backend.c provides mbedtls_sha256_process and needs MBEDTLS_SHA256_PROCESS_ALT"
+#endif
+
+typedef void (*nfc3d_sha256_process_fn)(mbedtls_sha256_context * ctx, const unsigned char data[64]);
+
+const uint32_t nfc3d_sha256_k[64] = {
+	0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+	0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+	0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+	0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+	0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+	0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+	0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+	0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
+};
+
+/*
+ * ARM11 backend. The MPCore has no SHA instructions or SIMD wide enough to
+ * help, so this is scalar code laid out for it: one LDR+REV per message word
+ * instead of four byte loads, a 16-word rolling schedule that stays in cache
+ * lines already touched, and rounds unrolled by eight with renamed registers
+ * so there are no moves between rounds.
+ */
+#define ROTR(x,n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define S0(x) (ROTR(x, 7) ^ ROTR(x,18) ^ ((x) >>  3))
+#define S1(x) (ROTR(x,17) ^ ROTR(x,19) ^ ((x) >> 10))
+
+#define S2(x) (ROTR(x, 2) ^ ROTR(x,13) ^ ROTR(x,22))
+#define S3(x) (ROTR(x, 6) ^ ROTR(x,11) ^ ROTR(x,25))
+
+#define F0(x,y,z) (((x) & (y)) | ((z) & ((x) | (y))))
+#define F1(x,y,z) ((z) ^ ((x) & ((y) ^ (z))))
+
+static inline uint32_t nfc3d_sha256_load_be32(const unsigned char * p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+#define ARMV6_ROUND(a,b,c,d,e,f,g,h,i) \
+	do { \
+		if ((i) >= 16) \
+			W[(i) & 15] += S1(W[((i) - 2) & 15]) + W[((i) - 7) & 15] + S0(W[((i) - 15) & 15]); \
+		temp1 = h + S3(e) + F1(e,f,g) + nfc3d_sha256_k[i] + W[(i) & 15]; \
+		d += temp1; \
+		h = temp1 + S2(a) + F0(a,b,c); \
+	} while (0)
+
+static void nfc3d_sha256_process_armv6(mbedtls_sha256_context * ctx, const unsigned char data[64]) {
+	uint32_t W[16];
+	uint32_t A, B, C, D, E, F, G, H, temp1;
+	unsigned int i;
+
+	for (i = 0; i < 16; i++) {
+		W[i] = nfc3d_sha256_load_be32(data + 4 * i);
+	}
+
+	A = ctx->state[0]; B = ctx->state[1]; C = ctx->state[2]; D = ctx->state[3];
+	E = ctx->state[4]; F = ctx->state[5]; G = ctx->state[6]; H = ctx->state[7];
+
+	for (i = 0; i < 64; i += 8) {
+		ARMV6_ROUND(A, B, C, D, E, F, G, H, i + 0);
+		ARMV6_ROUND(H, A, B, C, D, E, F, G, i + 1);
+		ARMV6_ROUND(G, H, A, B, C, D, E, F, i + 2);
+		ARMV6_ROUND(F, G, H, A, B, C, D, E, i + 3);
+		ARMV6_ROUND(E, F, G, H, A, B, C, D, i + 4);
+		ARMV6_ROUND(D, E, F, G, H, A, B, C, i + 5);
+		ARMV6_ROUND(C, D, E, F, G, H, A, B, i + 6);
+		ARMV6_ROUND(B, C, D, E, F, G, H, A, i + 7);
+	}
+
+	ctx->state[0] += A; ctx->state[1] += B; ctx->state[2] += C; ctx->state[3] += D;
+	ctx->state[4] += E; ctx->state[5] += F; ctx->state[6] += G; ctx->state[7] += H;
+}
+
+#if NFC3D_SHA256_HAVE_SHANI
+__attribute__((target("sha,sse4.1,ssse3")))
+static void nfc3d_sha256_process_shani(mbedtls_sha256_context * ctx, const unsigned char data[64]) {
+	const __m128i byteSwap = _mm_set_epi64x(0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL);
+	__m128i state0, state1, abefSave, cdghSave, msg, tmp;
+	__m128i W[4];
+	unsigned int i;
+
+	// Repack ABCD/EFGH into the ABEF/CDGH layout the SHA instructions use
+	tmp = _mm_loadu_si128((const __m128i *) &ctx->state[0]);
+	state1 = _mm_loadu_si128((const __m128i *) &ctx->state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);
+	state1 = _mm_shuffle_epi32(state1, 0x1B);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	abefSave = state0;
+	cdghSave = state1;
+
+	for (i = 0; i < 16; i++) {
+		if (i < 4) {
+			W[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16 * i)), byteSwap);
+		} else {
+			W[i & 3] = _mm_sha256msg2_epu32(
+					_mm_add_epi32(_mm_sha256msg1_epu32(W[i & 3], W[(i + 1) & 3]), _mm_alignr_epi8(W[(i + 3) & 3], W[(i + 2) & 3], 4)),
+					W[(i + 3) & 3]);
+		}
+
+		msg = _mm_add_epi32(W[i & 3], _mm_loadu_si128((const __m128i *) &nfc3d_sha256_k[4 * i]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+		msg = _mm_shuffle_epi32(msg, 0x0E);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+	}
+
+	state0 = _mm_add_epi32(state0, abefSave);
+	state1 = _mm_add_epi32(state1, cdghSave);
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+	_mm_storeu_si128((__m128i *) &ctx->state[0], state0);
+	_mm_storeu_si128((__m128i *) &ctx->state[4], state1);
+}
+
+static bool nfc3d_sha256_cpu_has_shani(void) {
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+	if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+		return false;
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+	return (ebx & bit_SHA) != 0;
+}
+#endif
+
+#if NFC3D_SHA256_HAVE_ARMV8
+__attribute__((target("+crypto")))
+static void nfc3d_sha256_process_armv8(mbedtls_sha256_context * ctx, const unsigned char data[64]) {
+	uint32x4_t state0, state1, abcdSave, efghSave, wk, tmp;
+	uint32x4_t W[4];
+	unsigned int i;
+
+	state0 = vld1q_u32(&ctx->state[0]);
+	state1 = vld1q_u32(&ctx->state[4]);
+	abcdSave = state0;
+	efghSave = state1;
+
+	for (i = 0; i < 4; i++) {
+		W[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+	}
+
+	for (i = 0; i < 16; i++) {
+		wk = vaddq_u32(W[i & 3], vld1q_u32(&nfc3d_sha256_k[4 * i]));
+
+		// Schedule the words four groups ahead while this group is consumed
+		if (i < 12) {
+			W[i & 3] = vsha256su1q_u32(vsha256su0q_u32(W[i & 3], W[(i + 1) & 3]), W[(i + 2) & 3], W[(i + 3) & 3]);
+		}
+
+		tmp = state0;
+		state0 = vsha256hq_u32(state0, state1, wk);
+		state1 = vsha256h2q_u32(state1, tmp, wk);
+	}
+
+	vst1q_u32(&ctx->state[0], vaddq_u32(state0, abcdSave));
+	vst1q_u32(&ctx->state[4], vaddq_u32(state1, efghSave));
+}
+
+static bool nfc3d_sha256_cpu_has_armv8(void) {
+#if defined(__linux__) && defined(HWCAP_SHA2)
+	return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+#elif defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO)
+	return true;
+#else
+	return false;
+#endif
+}
+#endif
+
+static const nfc3d_sha256_process_fn nfc3d_sha256_backends[NFC3D_SHA256_BACKEND_COUNT] = {
+	[NFC3D_SHA256_BACKEND_C] = mbedtls_sha256_process_c,
+	[NFC3D_SHA256_BACKEND_ARMV6] = nfc3d_sha256_process_armv6,
+#if NFC3D_SHA256_HAVE_SHANI
+	[NFC3D_SHA256_BACKEND_SHANI] = nfc3d_sha256_process_shani,
+#endif
+#if NFC3D_SHA256_HAVE_ARMV8
+	[NFC3D_SHA256_BACKEND_ARMV8] = nfc3d_sha256_process_armv8,
+#endif
+};
+
+static const char * const nfc3d_sha256_backend_names[NFC3D_SHA256_BACKEND_COUNT] = {
+	[NFC3D_SHA256_BACKEND_C] = "c",
+	[NFC3D_SHA256_BACKEND_ARMV6] = "armv6",
+	[NFC3D_SHA256_BACKEND_SHANI] = "sha-ni",
+	[NFC3D_SHA256_BACKEND_ARMV8] = "armv8-sha2",
+};
+
+static void nfc3d_sha256_process_resolve(mbedtls_sha256_context * ctx, const unsigned char data[64]);
+
+/*
+ * Any thread may be the first to hash, so the backend is resolved on first use
+ * by whichever threads get there. They all pick the same backend, and the
+ * atomics keep their stores from tearing or racing with the callers. Hashing
+ * only loads the pointer relaxed: every backend it can point at is static.
+ */
+static nfc3d_sha256_process_fn nfc3d_sha256_process_impl = nfc3d_sha256_process_resolve;
+static nfc3d_sha256_backend nfc3d_sha256_current = NFC3D_SHA256_BACKEND_C;
+
+void mbedtls_sha256_process(mbedtls_sha256_context * ctx, const unsigned char data[64]) {
+	__atomic_load_n(&nfc3d_sha256_process_impl, __ATOMIC_RELAXED)(ctx, data);
+}
+
+const char * nfc3d_sha256_backend_name(nfc3d_sha256_backend backend) {
+	if ((unsigned int) backend >= NFC3D_SHA256_BACKEND_COUNT)
+		return "unknown";
+	return nfc3d_sha256_backend_names[backend];
+}
+
+bool nfc3d_sha256_backend_available(nfc3d_sha256_backend backend) {
+	switch (backend) {
+		case NFC3D_SHA256_BACKEND_C:
+		case NFC3D_SHA256_BACKEND_ARMV6:
+			return true;
+#if NFC3D_SHA256_HAVE_SHANI
+		case NFC3D_SHA256_BACKEND_SHANI:
+			return nfc3d_sha256_cpu_has_shani();
+#endif
+#if NFC3D_SHA256_HAVE_ARMV8
+		case NFC3D_SHA256_BACKEND_ARMV8:
+			return nfc3d_sha256_cpu_has_armv8();
+#endif
+		default:
+			return false;
+	}
+}
+
+/*
+ * Deterministic xorshift32 stream for the differential checks
+ */
+static uint32_t nfc3d_sha256_test_random(uint32_t * x) {
+	*x ^= *x << 13;
+	*x ^= *x >> 17;
+	*x ^= *x << 5;
+	return *x;
+}
+
+/*
+ * Runs a backend against the C reference over random states and blocks
+ */
+static bool nfc3d_sha256_backend_matches_reference(nfc3d_sha256_backend backend, unsigned int rounds) {
+	mbedtls_sha256_context expected, actual;
+	unsigned char block[64];
+	uint32_t seed = 0x2545F491;
+	unsigned int round, i;
+
+	mbedtls_sha256_init(&expected);
+	mbedtls_sha256_starts(&expected, 0);
+
+	for (round = 0; round < rounds; round++) {
+		for (i = 0; i < sizeof(block); i++) {
+			block[i] = (unsigned char) nfc3d_sha256_test_random(&seed);
+		}
+		if (round % 8 == 0) {
+			for (i = 0; i < 8; i++) {
+				expected.state[i] = nfc3d_sha256_test_random(&seed);
+			}
+		}
+
+		actual = expected;
+		mbedtls_sha256_process_c(&expected, block);
+		nfc3d_sha256_backends[backend](&actual, block);
+
+		if (memcmp(expected.state, actual.state, sizeof(expected.state)) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+bool nfc3d_sha256_backend_select(nfc3d_sha256_backend backend) {
+	if (!nfc3d_sha256_backend_available(backend))
+		return false;
+
+	// Never trust a backend that disagrees with the reference
+	if (!nfc3d_sha256_backend_matches_reference(backend, 16))
+		return false;
+
+	__atomic_store_n(&nfc3d_sha256_current, backend, __ATOMIC_RELAXED);
+	__atomic_store_n(&nfc3d_sha256_process_impl, nfc3d_sha256_backends[backend], __ATOMIC_RELEASE);
+	return true;
+}
+
+static void nfc3d_sha256_process_resolve(mbedtls_sha256_context * ctx, const unsigned char data[64]) {
+	// Hardware first, then the ARM11 schedule on 32-bit ARM, else the reference
+	if (!nfc3d_sha256_backend_select(NFC3D_SHA256_BACKEND_SHANI) &&
+		!nfc3d_sha256_backend_select(NFC3D_SHA256_BACKEND_ARMV8)) {
+#if defined(__arm__)
+		if (!nfc3d_sha256_backend_select(NFC3D_SHA256_BACKEND_ARMV6))
+#endif
+			nfc3d_sha256_backend_select(NFC3D_SHA256_BACKEND_C);
+	}
+
+	__atomic_load_n(&nfc3d_sha256_process_impl, __ATOMIC_RELAXED)(ctx, data);
+}
+
+nfc3d_sha256_backend nfc3d_sha256_backend_current(void) {
+	if (__atomic_load_n(&nfc3d_sha256_process_impl, __ATOMIC_ACQUIRE) == nfc3d_sha256_process_resolve) {
+		mbedtls_sha256_context ctx;
+		unsigned char block[64] = { 0 };
+
+		mbedtls_sha256_init(&ctx);
+		mbedtls_sha256_process(&ctx, block);
+		mbedtls_sha256_free(&ctx);
+	}
+	return __atomic_load_n(&nfc3d_sha256_current, __ATOMIC_RELAXED);
+}
+
+/*
+ * Checks every available backend with the mbedtls test vectors (when built
+ * with MBEDTLS_SELF_TEST) and a randomized differential run against the C
+ * reference. The previously selected backend is restored afterwards.
+ */
+int nfc3d_sha256_backend_self_test(int verbose) {
+	nfc3d_sha256_backend previous = nfc3d_sha256_backend_current();
+	int backend;
+	int ret = 0;
+
+	for (backend = 0; backend < NFC3D_SHA256_BACKEND_COUNT; backend++) {
+		if (!nfc3d_sha256_backend_available((nfc3d_sha256_backend) backend)) {
+			if (verbose != 0)
+				printf("  SHA-256 backend %s: not available\n", nfc3d_sha256_backend_name((nfc3d_sha256_backend) backend));
+			continue;
+		}
+
+		bool passed = nfc3d_sha256_backend_matches_reference((nfc3d_sha256_backend) backend, 4096);
+#if defined(MBEDTLS_SELF_TEST)
+		if (passed && nfc3d_sha256_backend_select((nfc3d_sha256_backend) backend))
+			passed = mbedtls_sha256_self_test(0) == 0;
+#endif
+
+		if (verbose != 0)
+			printf("  SHA-256 backend %s: %s\n", nfc3d_sha256_backend_name((nfc3d_sha256_backend) backend), passed ? "passed" : "failed");
+		if (!passed)
+			ret = 1;
+	}
+
+	nfc3d_sha256_backend_select(previous);
+	return ret;
+}
@@ -0,0 +1,85 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "nfc3d/sha256x.h"
+#include "nfc3d/sha256_backend.h"
+#include <string.h>
+
+typedef uint32_t nfc3d_u32x4 __attribute__((vector_size(16)));
+typedef uint32_t nfc3d_u32x8 __attribute__((vector_size(32)));
+
+/* The 8-lane kernel gets an AVX2 clone, resolved by the loader at startup */
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__) && !defined(__clang__)
+#define NFC3D_SHA256X8_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define NFC3D_SHA256X8_TARGETS
+#endif
+
+#define ROTR(x,n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define S0(x) (ROTR(x, 7) ^ ROTR(x,18) ^ ((x) >>  3))
+#define S1(x) (ROTR(x,17) ^ ROTR(x,19) ^ ((x) >> 10))
+
+#define S2(x) (ROTR(x, 2) ^ ROTR(x,13) ^ ROTR(x,22))
+#define S3(x) (ROTR(x, 6) ^ ROTR(x,11) ^ ROTR(x,25))
+
+#define F0(x,y,z) (((x) & (y)) | ((z) & ((x) | (y))))
+#define F1(x,y,z) ((z) ^ ((x) & ((y) ^ (z))))
+
+#define GET_UINT32_BE(b) \
+	(((uint32_t) (b)[0] << 24) | ((uint32_t) (b)[1] << 16) | ((uint32_t) (b)[2] << 8) | ((uint32_t) (b)[3]))
+
+/*
+ * Both kernels share one body, only the vector type and lane count differ
+ */
+#define NFC3D_SHA256X_PROCESS(vector, lanes, state, blocks) \
+	do { \
+		vector W[16]; \
+		vector A[8]; \
+		vector temp1, temp2; \
+		unsigned int i, lane; \
+		\
+		memcpy(A, state, sizeof(A)); \
+		\
+		for (i = 0; i < 16; i++) { \
+			for (lane = 0; lane < (lanes); lane++) { \
+				W[i][lane] = GET_UINT32_BE(blocks[lane] + 4 * i); \
+			} \
+		} \
+		\
+		/* Message schedule is kept as a rolling 16-entry window */ \
+		for (i = 0; i < 64; i++) { \
+			if (i >= 16) { \
+				W[i & 15] += S1(W[(i - 2) & 15]) + W[(i - 7) & 15] + S0(W[(i - 15) & 15]); \
+			} \
+			\
+			temp1 = A[7] + S3(A[4]) + F1(A[4], A[5], A[6]) + nfc3d_sha256_k[i] + W[i & 15]; \
+			temp2 = S2(A[0]) + F0(A[0], A[1], A[2]); \
+			\
+			A[7] = A[6]; \
+			A[6] = A[5]; \
+			A[5] = A[4]; \
+			A[4] = A[3] + temp1; \
+			A[3] = A[2]; \
+			A[2] = A[1]; \
+			A[1] = A[0]; \
+			A[0] = temp1 + temp2; \
+		} \
+		\
+		for (i = 0; i < 8; i++) { \
+			vector s; \
+			memcpy(&s, state[i], sizeof(s)); \
+			s += A[i]; \
+			memcpy(state[i], &s, sizeof(s)); \
+		} \
+	} while (0)
+
+void nfc3d_sha256x4_process(uint32_t state[8][NFC3D_SHA256X4_LANES], const uint8_t * const blocks[NFC3D_SHA256X4_LANES]) {
+	NFC3D_SHA256X_PROCESS(nfc3d_u32x4, NFC3D_SHA256X4_LANES, state, blocks);
+}
+
+NFC3D_SHA256X8_TARGETS
+void nfc3d_sha256x8_process(uint32_t state[8][NFC3D_SHA256X8_LANES], const uint8_t * const blocks[NFC3D_SHA256X8_LANES]) {
+	NFC3D_SHA256X_PROCESS(nfc3d_u32x8, NFC3D_SHA256X8_LANES, state, blocks);
+}
@@ -0,0 +1,223 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Packs one amiibo for a list of UIDs, one tag image per UID. This is a host
+ * tool and not part of the 3DS build, see amitool/README.md for how to build it.
+ */
+
+#include "nfc3d/amiibo.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_DUMP_SIZE 572
+
+static char * self;
+
+static void usage() {
+	fprintf(stderr,
+		"uidbatch\n"
+		"Usage: %s -k keys [-i input] [-o prefix] [-p] [-l] [-u list] [uid...]\n"
+		"   -k key set file. For retail amiibo, use \"retail unfixed\" key set\n"
+		"   -i input dump. If not specified, stdin will be used.\n"
+		"   -o output prefix, images are written to <prefix><UID>.bin. Defaults to the working directory.\n"
+		"   -p input is already decrypted.\n"
+		"   -l decrypt files with invalid signatures.\n"
+		"   -u file with one UID per line, in addition to those on the command line.\n"
+		"   UIDs are 7 bytes (14 hex digits) or 9 bytes including both BCC bytes (18 hex digits), which must match.\n",
+		self
+	);
+}
+
+static bool parse_uid(const char * text, uint8_t * uid9) {
+	uint8_t bytes[NFC3D_AMIIBO_UID9_SIZE];
+	size_t count = 0;
+
+	while (*text != '\0' && *text != '\n' && *text != '\r') {
+		if (*text == ':' || *text == ' ') {
+			text++;
+			continue;
+		}
+		// Whole pairs of hex digits only, so a typo never turns into another UID
+		if (count >= sizeof(bytes) || !isxdigit((unsigned char) text[0]) || !isxdigit((unsigned char) text[1]))
+			return false;
+		char pair[3] = { text[0], text[1], '\0' };
+		bytes[count++] = (uint8_t) strtoul(pair, NULL, 16);
+		text += 2;
+	}
+
+	if (count == NFC3D_AMIIBO_UID7_SIZE) {
+		nfc3d_amiibo_uid7_to_uid9(bytes, uid9);
+	} else if (count == NFC3D_AMIIBO_UID9_SIZE) {
+		// Rebuild the BCC bytes from the other seven, a tag with wrong ones never reads back
+		const uint8_t uid7[NFC3D_AMIIBO_UID7_SIZE] = { bytes[0], bytes[1], bytes[2], bytes[4], bytes[5], bytes[6], bytes[7] };
+		nfc3d_amiibo_uid7_to_uid9(uid7, uid9);
+		if (memcmp(uid9, bytes, NFC3D_AMIIBO_UID9_SIZE) != 0)
+			return false;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+static bool add_uid(uint8_t ** uids, size_t * count, size_t * capacity, const char * text) {
+	if (*count == *capacity) {
+		size_t newCapacity = *capacity ? *capacity * 2 : 64;
+		uint8_t * grown = realloc(*uids, newCapacity * NFC3D_AMIIBO_UID9_SIZE);
+		if (!grown)
+			return false;
+		*uids = grown;
+		*capacity = newCapacity;
+	}
+
+	if (!parse_uid(text, *uids + *count * NFC3D_AMIIBO_UID9_SIZE)) {
+		fprintf(stderr, "Invalid UID: %s\n", text);
+		return false;
+	}
+	(*count)++;
+	return true;
+}
+
+int main(int argc, char ** argv) {
+	self = argv[0];
+
+	char * infile = NULL;
+	char * prefix = "";
+	char * keyfile = NULL;
+	char * listfile = NULL;
+	bool plainInput = false;
+	bool lenient = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "k:i:o:u:pl")) != -1) {
+		switch (opt) {
+			case 'k':
+				keyfile = optarg;
+				break;
+			case 'i':
+				infile = optarg;
+				break;
+			case 'o':
+				prefix = optarg;
+				break;
+			case 'u':
+				listfile = optarg;
+				break;
+			case 'p':
+				plainInput = true;
+				break;
+			case 'l':
+				lenient = true;
+				break;
+			default:
+				usage();
+				return 2;
+		}
+	}
+
+	if (keyfile == NULL) {
+		usage();
+		return 1;
+	}
+
+	nfc3d_amiibo_keys rawKeys;
+	if (!nfc3d_amiibo_load_keys(&rawKeys, keyfile)) {
+		fprintf(stderr, "Could not load keys from \"%s\": %s (%d)\n", keyfile, strerror(errno), errno);
+		return 5;
+	}
+	nfc3d_amiibo_preparedkeys amiiboKeys;
+	nfc3d_amiibo_prepare_keys(&rawKeys, &amiiboKeys);
+
+	uint8_t * uids = NULL;
+	size_t uidCount = 0, uidCapacity = 0;
+	for (int i = optind; i < argc; i++) {
+		if (!add_uid(&uids, &uidCount, &uidCapacity, argv[i]))
+			return 2;
+	}
+	if (listfile) {
+		FILE * f = fopen(listfile, "r");
+		char line[64];
+		if (!f) {
+			fprintf(stderr, "Could not open UID list \"%s\": %s (%d)\n", listfile, strerror(errno), errno);
+			return 3;
+		}
+		while (fgets(line, sizeof(line), f)) {
+			if (line[0] == '\n' || line[0] == '\r' || line[0] == '#')
+				continue;
+			if (!add_uid(&uids, &uidCount, &uidCapacity, line)) {
+				fclose(f);
+				return 2;
+			}
+		}
+		fclose(f);
+	}
+	if (uidCount == 0) {
+		usage();
+		return 1;
+	}
+
+	uint8_t original[MAX_DUMP_SIZE];
+	uint8_t plain[MAX_DUMP_SIZE];
+	size_t readBytes = 0;
+
+	FILE * f = stdin;
+	if (infile) {
+		f = fopen(infile, "rb");
+		if (!f) {
+			fprintf(stderr, "Could not open input file\n");
+			return 3;
+		}
+	}
+	readBytes = fread(original, 1, sizeof(original), f);
+	if (readBytes < NFC3D_AMIIBO_SIZE) {
+		fprintf(stderr, "Could not read from input\n");
+		return 3;
+	}
+	if (f != stdin)
+		fclose(f);
+
+	// Extra bytes past the amiibo data are carried over untouched
+	memcpy(plain, original, readBytes);
+	if (!plainInput && !nfc3d_amiibo_unpack(&amiiboKeys, original, plain)) {
+		fprintf(stderr, "!!! WARNING !!!: Tag signature was NOT valid\n");
+		if (!lenient)
+			return 6;
+	}
+
+	uint8_t * images = malloc(uidCount * MAX_DUMP_SIZE);
+	const uint8_t ** uidPtrs = malloc(uidCount * sizeof(*uidPtrs));
+	uint8_t ** imagePtrs = malloc(uidCount * sizeof(*imagePtrs));
+	if (!images || !uidPtrs || !imagePtrs) {
+		fprintf(stderr, "Out of memory\n");
+		return 7;
+	}
+	for (size_t i = 0; i < uidCount; i++) {
+		uidPtrs[i] = uids + i * NFC3D_AMIIBO_UID9_SIZE;
+		imagePtrs[i] = images + i * MAX_DUMP_SIZE;
+		memcpy(imagePtrs[i], plain, readBytes);
+	}
+
+	nfc3d_amiibo_pack_uids(&amiiboKeys, plain, uidPtrs, imagePtrs, uidCount);
+
+	for (size_t i = 0; i < uidCount; i++) {
+		const uint8_t * uid = uidPtrs[i];
+		char path[4096];
+		snprintf(path, sizeof(path), "%s%02X%02X%02X%02X%02X%02X%02X.bin", prefix,
+				uid[0], uid[1], uid[2], uid[4], uid[5], uid[6], uid[7]);
+
+		f = fopen(path, "wb");
+		if (!f || fwrite(imagePtrs[i], readBytes, 1, f) != 1) {
+			fprintf(stderr, "Could not write \"%s\"\n", path);
+			return 4;
+		}
+		fclose(f);
+	}
+
+	free(imagePtrs);
+	free(uidPtrs);
+	free(images);
+	free(uids);
+	return 0;
+}
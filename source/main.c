@@ -23,6 +23,21 @@
 
 #define AMIIBO_DUMP_ROOT "sdmc:/amiibo"
 
+// Time the dump cipher on every AES backend at startup
+#define CRYPTO_BENCHMARK 0
+#define CRYPTO_BENCHMARK_ROUNDS 1000
+
+#if CRYPTO_BENCHMARK
+#include "nfc3d/amiibo.h"
+#include "nfc3d/aes_backend.h"
+#endif
+
+// CRYPTO_SELF_TEST comes from the Makefile, it also enables the mbedtls test vectors
+#ifdef CRYPTO_SELF_TEST
+#include "nfc3d/aes_backend.h"
+#include "nfc3d/sha256_backend.h"
+#endif
+
 void printbuf(char *prefix, u8* data, size_t len);
 void uiShowTagInfo();
 
@@ -88,87 +103,95 @@ END_loadDump:
 	uiUpdateStatus("");
 }
 
-void writeToTag() {
-	if (!tag_isKeysLoaded()) {
-		printf("No keys loaded\n");
-		return;
-	}
-	if (!tag_isLoaded()) {
-		printf("No tag loaded\n");
-		return;
-	}
-	
-	uiSelectMain();
-	//todo: show title as write to tag / restore tag
-	printf("\e[2J\e[H\e[0m\e[5;2HPlace tag on scanner, or press B to cancel");
-	uiUpdateStatus("Waiting...");
-	uiSelectLog();
-	u8 firstPages[NTAG_BLOCK_SIZE];
-	
-	int res = nfc_readBlock(0, firstPages, sizeof(firstPages));
-	if (res != 0) {
-		printf("Failed to get UID: %d\n", res);
-		goto writeToTag_ERROR;
-	}
-	
+/*
+runs inside the write session once the tag's first pages are read: re-keys the
+loaded amiibo to this tag's UID and picks the write mode
+*/
+static Result prepareWrite(u8 *firstPages, int firstPagesLen, u8 *data, int datalen, u8 *pwd, int *fullWrite, void *userdata) {
 	printf("Got new UID\n");
-	res = tag_setUid(firstPages, 9);
+	int res = tag_setUid(firstPages, 9);
 	if (res != TAG_ERR_OK) {
 		printf("Failed to update UID: %d\n", res);
-		goto writeToTag_ERROR;
+		return res;
 	}
 	uiUpdateStatus("Encrypting.");
 	printf("Encrypting...\n");
-	u8 data[AMIIBO_MAX_SIZE];
-	res = tag_getTag(data, sizeof(data));
+	res = tag_getTag(data, datalen);
 	if (res != TAG_ERR_OK) {
 		printf("Failed to encrypt tag: %d\n", res);
-		goto writeToTag_ERROR;
+		return res;
 	}
 	/*
 	printf("Backup...\n");
-	res = writeFile("sdmc:/amiibo/out.bin", data, sizeof(data));
+	res = writeFile("sdmc:/amiibo/out.bin", data, datalen);
 	if (res <0)
 		printf("Write to disk failed: %d\n", res);
 	*/
 	
 	u8 uid[7];
-	res = tag_getUidFromBlock(firstPages, sizeof(firstPages), uid, sizeof(uid));
+	res = tag_getUidFromBlock(firstPages, firstPagesLen, uid, sizeof(uid));
 	if (res != TAG_ERR_OK) {
 		printf("Failed to get uid: %d\n", res);
-		goto writeToTag_ERROR;
+		return res;
 	}
 	
 	printf("Calculating password...\n");
-	u8 pwd[NTAG_PAGE_SIZE];
-	res = tag_calculatePassword(uid, sizeof(uid), pwd, sizeof(pwd));
+	res = tag_calculatePassword(uid, sizeof(uid), pwd, NTAG_PAGE_SIZE);
 	if (res != TAG_ERR_OK) {
 		printf("Failed to calculate pwd: %d\n", res);
-		goto writeToTag_ERROR;
+		return res;
 	}
 	
-	if (tag_isLocked(firstPages, sizeof(firstPages))) {
+	if (tag_isLocked(firstPages, firstPagesLen)) {
 		//already an amiibo, write only game data
 		printf("Locked tag. Writing game data..\n");
-		res = nfc_write(data, sizeof(data), pwd, sizeof(pwd), 0);
-		if (res != 0) {
-			printf("nfc write failed %d\n", res);
-			goto writeToTag_ERROR;
-		}
+		*fullWrite = 0;
 	} else {
 		//blank tag. write full amiibo
 		printf("Writing to blank tag...\n");
-		res = nfc_write(data, sizeof(data), pwd, sizeof(pwd), 1);
-		if (res != 0) {
+		*fullWrite = 1;
+	}
+	return 0;
+}
+
+void writeToTag() {
+	if (!tag_isKeysLoaded()) {
+		printf("No keys loaded\n");
+		return;
+	}
+	if (!tag_isLoaded()) {
+		printf("No tag loaded\n");
+		return;
+	}
+	if (tag_verify() != TAG_ERR_OK) {
+		printf("Failed to decrypt tag\n");
+		return;
+	}
+	
+	uiSelectMain();
+	//todo: show title as write to tag / restore tag
+	printf("\e[2J\e[H\e[0m\e[5;2HPlace tag on scanner, or press B to cancel");
+	uiUpdateStatus("Waiting...");
+	uiSelectLog();
+	
+	//the tag stays in range from reading its UID to the last page written
+	u8 data[AMIIBO_MAX_SIZE];
+	u8 pwd[NTAG_PAGE_SIZE];
+	int res = nfc_writeSession(data, sizeof(data), pwd, sizeof(pwd), prepareWrite, NULL);
+	if (res != 0) {
+		if (res == NFC_ERR_TAG_REMOVED)
+			printf("Tag removed, write again to resume\n");
+		else
 			printf("nfc write failed %d\n", res);
-			goto writeToTag_ERROR;
-		}
+		goto writeToTag_ERROR;
 	}
 
+	nfc_writeStats stats;
+	nfc_getWriteStats(&stats);
 	uiUpdateStatus("Complete.");
 	uiUpdateProgress(0, -1);
 	uiSelectMain();
-	printf("\e[2J\e[H\e[0m\e[5;2HFinished writing to tag.\n\n   Press A to continue.");
+	printf("\e[2J\e[H\e[0m\e[5;2HFinished writing to tag.\n\n   %d pages written, %d rewritten after verify,\n   %d retries, %d NAKs.\n\n   Press A to continue.", stats.pagesWritten, stats.verifyMismatches, stats.retries, stats.naks);
 	uiGetKey(KEY_A);
 	return;
 	
@@ -180,22 +203,43 @@ writeToTag_ERROR:
 	uiUpdateStatus("");
 }
 
-void dumpTagToFile() {
+//hands each chunk nfc_readFull brings in to the verify pipeline
+static Result dumpChunk(u8 *data, int size, void *userdata) {
+	thenaya_pipelineFeed(userdata, data, size);
+	return 0;
+}
+
+/*
+amiiboOnly stops at the first sign of another kind of tag and saves nothing,
+so bulk dumping does not pay for a full read of every wrong tag
+*/
+void dumpTagToFile(int amiiboOnly) {
 	uiSelectMain();
 	//todo: show title as write to tag / restore tag
 	printf("\e[2J\e[H\e[0m\e[5;2HPlace tag on scanner, or press B to cancel");
 	uiUpdateStatus("Waiting...");
 	u8 data[AMIIBO_MAX_SIZE];
 	uiSelectLog();
-	int res = nfc_readFull(data, sizeof(data));
+	//with keys loaded the dump is checked as it comes in, keygen overlapping the read
+	thenaya_pipeline *pipeline = NULL;
+	if (tag_isKeysLoaded())
+		thenaya_pipelineCreate(&pipeline, tag_getKeys());
+	int res = nfc_readFull(data, sizeof(data), amiiboOnly, pipeline ? dumpChunk : NULL, pipeline);
 	if (res != 0) {
-		printf("Scanning failed\n");
+		thenaya_pipelineDestroy(pipeline);
+		printf(res == NFC_ERR_NOT_AMIIBO ? "Not an amiibo, nothing saved\n" : "Scanning failed\n");
 		goto dumpTagToFile_ERROR;
 	}
 	
 	if (!tag_isValid(data, sizeof(data))) {
 		printf("WARNING: Likely not an amiibo.\n");
+	} else if (pipeline) {
+		if (thenaya_pipelineFinish(pipeline, data, sizeof(data)) == THENAYA_ERR_OK)
+			printf("Amiibo data verified.\n");
+		else
+			printf("WARNING: Amiibo data does not match its signature.\n");
 	}
+	thenaya_pipelineDestroy(pipeline);
 	
 	uiUpdateStatus("Saving..");
 	mkdir(AMIIBO_DUMP_ROOT, 0777);
@@ -287,12 +331,13 @@ u32 showMenu() {
 		printf("\e[3;1H A - Write/Restore Tag.");
 	printf("\e[2;26H Y - Dump Tag to file.");
 	printf("\e[3;26H B - Quit.");
+	printf("\e[4;26H R - Dump amiibo only.");
 	uiSelectLog();
 	
 	if (tag_isLoaded()) {
 		uiShowTagInfo();
 	}
-	return uiGetKey(KEY_X | KEY_A | KEY_Y | KEY_B);
+	return uiGetKey(KEY_X | KEY_A | KEY_Y | KEY_R | KEY_B);
 }
 
 void menu() {
@@ -304,12 +349,52 @@ void menu() {
 		} else if ((kDown & KEY_A) && tag_isLoaded() && tag_isKeysLoaded()) {
 			writeToTag();
 		} else if (kDown & KEY_Y) {
-			dumpTagToFile();
+			dumpTagToFile(0);
+		} else if (kDown & KEY_R) {
+			dumpTagToFile(1);
 		} else if (kDown & KEY_B)
 			break;
 	}
 }
 
+#if CRYPTO_BENCHMARK
+void benchmarkCipher() {
+	uiSelectLog();
+	nfc3d_keygen_derivedkeys keys;
+	u8 in[NFC3D_AMIIBO_SIZE];
+	u8 out[NFC3D_AMIIBO_SIZE];
+	memset(&keys, 0x5A, sizeof(keys));
+	memset(in, 0xA5, sizeof(in));
+	
+	nfc3d_aes_backend previous = nfc3d_aes_backend_current();
+	for (int backend = 0; backend < NFC3D_AES_BACKEND_COUNT; backend++) {
+		if (!nfc3d_aes_backend_select((nfc3d_aes_backend) backend)) {
+			continue;
+		}
+		u64 start = svcGetSystemTick();
+		for (int i = 0; i < CRYPTO_BENCHMARK_ROUNDS; i++) {
+			nfc3d_amiibo_cipher(&keys, in, out);
+		}
+		u64 ticks = (svcGetSystemTick() - start) / CRYPTO_BENCHMARK_ROUNDS;
+		printf("AES %s: %llu ticks/dump (%llu us)\n", nfc3d_aes_backend_name((nfc3d_aes_backend) backend), ticks, ticks * 1000000 / SYSCLOCK_ARM11);
+	}
+	nfc3d_aes_backend_select(previous);
+}
+#endif
+
+#ifdef CRYPTO_SELF_TEST
+void selfTestCrypto() {
+	uiSelectLog();
+	printf("Crypto self test\n");
+	int failed = nfc3d_sha256_backend_self_test(1);
+	failed |= nfc3d_aes_backend_self_test(1);
+	if (failed) {
+		printf("Crypto self test failed\n");
+		uiUpdateStatus("ERROR");
+	}
+}
+#endif
+
 int main() {
 	uiInit();
 	
@@ -320,6 +405,14 @@ int main() {
 	gfxSwapBuffers();
 	gspWaitForVBlank();
 	
+	#if CRYPTO_BENCHMARK
+	benchmarkCipher();
+	#endif
+	
+	#ifdef CRYPTO_SELF_TEST
+	selfTestCrypto();
+	#endif
+	
 	if (loadKeys()) {
 		if (nfc_init()) {
 			menu();
@@ -10,23 +10,160 @@
 #include "nfc.h"
 #include "filepicker.h"
 #include "nfc3d/amitool.h"
+#include "nfc3d/amiibo.h"
+#include "mbedtls/sha256.h"
 #include "ui.h"
 #include "util2.h"
 
 #define NFC_EMULATE 0
 
-#define NFC_TIMEOUT  200 * 1000000
+//nfcSendTagCommand timeouts are in microseconds
+#define NFC_TIMEOUT  200 * 1000
+
+//retries of a single command on timeout, NAK or short reply, with the pause doubling from NFC_RETRY_BACKOFF each time
+#define NFC_RETRY_COUNT 3
+#define NFC_RETRY_BACKOFF 5 * 1000000 //nanoseconds, for svcSleepThread
+//commands get NFC_TIMEOUT_FACTOR times the slowest of the last NFC_RTT_SAMPLES round trips of their kind (the p99
+//of such a small window), scaled up to the length of the reply they expect
+#define NFC_RTT_SAMPLES 32
+#define NFC_RTT_MIN_SAMPLES 8
+#define NFC_TIMEOUT_FACTOR 4
+#define NFC_TIMEOUT_MIN 20 * 1000
+
+//command kinds keeping their own round trip statistics, a 4 byte WRITE says little about a long FAST_READ
+#define RTT_KIND_READ 0
+#define RTT_KIND_OTHER 1
+#define RTT_KINDS 2
+
+#define NFC_ERR_NAK -2
+
+//tag detection runs on a thread of its own. It wakes on the NFC module's range events, or
+//after NFC_DETECT_POLL in case those do not fire for raw scans, and queues every change of
+//tag state for the scan and write code
+#define NFC_DETECT_STACK_SIZE 0x1000
+#define NFC_DETECT_POLL 2 * 1000000
+#define NFC_EVENT_QUEUE_SIZE 8
+//how often a wait for a tag looks at the buttons, for B to cancel
+#define NFC_CANCEL_POLL 16 * 1000000
+
+//FAST_READ spans, in pages. The reader's limit is searched for between the last span that worked and the
+//smallest that failed; anything up to the former is known good and gets the normal retries
+#define NFC_FAST_READ_MAX_SPAN (NTAG_215_LAST_PAGE + 1)
+//FAST_READs in a row that went through before a lowered limit is searched above again, one failed
+//probe may have been a tag at the edge of the field. Doubles up to the max each time that finds nothing
+#define NFC_FAST_READ_REPROBE 32
+#define NFC_FAST_READ_REPROBE_MAX 1024
+//pages holding the keygen seed, read on their own first when the caller wants chunks
+#define NFC_SEED_PAGES (NFC3D_AMIIBO_SEED_TAG_END / NTAG_PAGE_SIZE)
 
 #define CMD_FAST_READ(pagestart, pagecount) {0x3A, pagestart, pagestart+pagecount-1}
 #define CMD_READ(pagestart) {0x30, pagestart}
 #define CMD_WRITE(pagestart, data) {0xA2, pagestart, data[0], data[1], data[2], data[3]}
 #define CMD_AUTH(pwd) {0x1B, pwd[0], pwd[1], pwd[2], pwd[3]}
+#define CMD_GET_VERSION {0x60}
 
 #define NTAG_PACK {0x80, 0x80, 0x00, 0x00}
+#define NTAG_ACK 0x0A
 
 #define NTAG_215_LAST_PAGE 0x86
 
+//GET_VERSION reply: fixed header, vendor, product type, subtype, major, minor, storage size, protocol
+#define NTAG_VERSION_SIZE 8
+#define NTAG_VERSION_VENDOR_NXP 0x04
+#define NTAG_VERSION_TYPE_NTAG 0x04
+#define NTAG_VERSION_STORAGE_213 0x0F
+#define NTAG_VERSION_STORAGE_215 0x11
+#define NTAG_VERSION_STORAGE_216 0x13
+
+//rounds of readback and rewrite after writing, 0 turns the check off
+#define NFC_VERIFY_ROUNDS 2
+
+//progress of the current write, so lifting the tag does not mean starting over
+#define NFC_JOURNAL_PATH "sdmc:/amiibo_write.journal"
+#define NFC_JOURNAL_MAGIC 0x334A5754 //"TWJ3"
+#define NFC_JOURNAL_SAVE_INTERVAL 16 //pages between saves, it is also saved whenever a write fails
+#define NFC_JOURNAL_DATA_DONE 0xFF //every data page is on the tag and read back, only the final steps remain
+
+//the pages that identify a write, from the UID to the last user page
+#define NFC_JOURNAL_IMAGE_SIZE ((0x81 + 1) * NTAG_PAGE_SIZE)
+
+typedef struct {
+	u32 magic;
+	u8 imageHash[32];
+	u8 fullWrite;
+	u8 nextPage; //first page not acknowledged yet, pages go out in ascending order
+	u8 finalStep; //FINAL_* steps of a full write acknowledged, once the data is done
+} writeJournal;
+
+//what a full write does after the data pages, in this order
+#define FINAL_OTP 0
+#define FINAL_PACK 1
+#define FINAL_PWD 2
+#define FINAL_STATIC_LOCK 3
+#define FINAL_DYNAMIC_LOCK 4
+#define FINAL_CFG0 5
+#define FINAL_CFG1 6
+#define FINAL_STEP_COUNT 7
+
+typedef struct {
+	u32 us; //round trip, microseconds
+	u32 bytes; //length of the reply it brought
+} rttSample;
+
+typedef struct {
+	Result result; //of nfcGetTagState, state is only meaningful if this succeeded
+	NFC_TagState state;
+	int scan; //scanGeneration it was seen in, anything older is stale
+} tagEvent;
+
 static Result nfc_auth(u8 *PWD);
+static Result waitForTag();
+static Result fastRead(int startPage, int pageCount, u8 *image, nfc_readChunk chunk, void *userdata);
+static Result checkVersion();
+static Result checkHeader(u8 *data, int size, void *userdata);
+static Result startScan();
+static void stopScan();
+static int nextTagEvent(tagEvent *event, s64 timeout);
+static int tagRemoved();
+static void closeRangeEvents();
+
+static int verifyRounds = NFC_VERIFY_ROUNDS;
+
+//what checkHeader passes the chunks on to
+typedef struct {
+	nfc_readChunk chunk;
+	void *userdata;
+	int checked;
+} headerCheck;
+static nfc_writeStats lastWriteStats;
+
+static int fastReadGood = NTAG_FAST_READ_PAGE_COUNT; //largest span seen to work
+static int fastReadLimit = NFC_FAST_READ_MAX_SPAN; //largest span not seen to fail
+static int fastReadStreak = 0; //FAST_READs that went through since the last one failed
+static int fastReadReprobe = NFC_FAST_READ_REPROBE;
+
+static rttSample rttSamples[RTT_KINDS][NFC_RTT_SAMPLES];
+static int rttCount[RTT_KINDS];
+static int rttNext[RTT_KINDS];
+
+//password of the current session, sent again when a retry finds the tag may have reset
+static u8 authPwd[NTAG_PAGE_SIZE];
+static int authActive = 0;
+
+static Thread detectThread = NULL;
+static volatile int detectQuit = 0;
+static volatile int scanGeneration = 0; //bumped by every startScan
+static volatile int scanning = 0;
+static LightEvent scanArmed; //signalled while scanning, the detection thread sleeps on it otherwise
+static Handle rangeEvents[2]; //tag in range, tag out of range, 0 if unavailable
+
+//filled by the detection thread, drained by whoever waits on the tag
+static LightLock queueLock;
+static LightEvent queueSignal; //signalled while the queue holds events
+static tagEvent eventQueue[NFC_EVENT_QUEUE_SIZE];
+static int queueHead = 0;
+static int queueCount = 0;
+static NFC_TagState lastTagState = NFC_TagState_Uninitialized; //latest state taken off the queue
 
 #if !NFC_EMULATE
 
@@ -65,10 +202,17 @@ static void DnfcStopScanning() {
 }
 #endif
 
-Result nfc_readFull(u8 *data, int datalen) {
+/*
+reads the whole tag. With a chunk callback the seed pages come in a read of their
+own, so the caller can start keygen while the rest is still on its way. strict
+stops the read as soon as the tag shows it is no amiibo
+*/
+Result nfc_readFull(u8 *data, int datalen, int strict, nfc_readChunk chunk, void *userdata) {
 	#if NFC_EMULATE
 	
 	readFile("sdmc:/linkarcheramiibo.bin", data, datalen);
+	if (chunk)
+		chunk(data, datalen, userdata);
 	
 	return 0;
 	
@@ -77,84 +221,35 @@ Result nfc_readFull(u8 *data, int datalen) {
 	if (datalen < NTAG_PAGE_SIZE * 4) {
 		return -1;
 	}
-	Result ret=0;
-
-	NFC_TagState prevstate, curstate;
-
-	ret = DnfcStartOtherTagScanning(NFC_STARTSCAN_DEFAULTINPUT, 0x01);
-	if(R_FAILED(ret)) {
-		printf("StartOtherTagScanning() failed: 0x%08x.\n", (unsigned int)ret);
+	
+	Result ret = waitForTag();
+	if (R_FAILED(ret))
 		return ret;
-	}
-
-	prevstate = NFC_TagState_Uninitialized;
-	while (1) {
-		gspWaitForVBlank();
-		hidScanInput();
-
-		u32 kDown = hidKeysDown();
-		
-		if(kDown & KEY_B) {
-			ret = -1;
-			printf("Cancelled.\n");
-			break;
-		}
-		
-		ret = DnfcGetTagState(&curstate);
-		if(R_FAILED(ret)) {
-			printf("nfcGetTagState() failed: 0x%08x.\n", (unsigned int)ret);
-			DnfcStopScanning();
+	
+	//in strict mode a wrong tag costs the GET_VERSION, or at most the first FAST_READ
+	headerCheck check = {chunk, userdata, 0};
+	if (strict) {
+		ret = checkVersion();
+		if (R_FAILED(ret)) {
+			stopScan();
 			return ret;
 		}
-		
-		if(curstate!=prevstate) {
-			prevstate = curstate;
-			if(curstate==NFC_TagState_InRange) {
-				uiUpdateStatus("Tag detected.");
-				u8 tagdata[AMIIBO_MAX_SIZE];
-				memset(tagdata, 0, sizeof(tagdata));
-				
-				printf("Reading tag");
-				for(int i=0x00; i<=NTAG_215_LAST_PAGE ;i+=NTAG_FAST_READ_PAGE_COUNT) {
-					uiUpdateStatus("Reading.");
-					uiUpdateProgress(i, NTAG_215_LAST_PAGE);
-					u8 cmd[] = CMD_FAST_READ(i, NTAG_FAST_READ_PAGE_COUNT);
-					u8 cmdresult[NTAG_FAST_READ_PAGE_COUNT*NTAG_PAGE_SIZE];
-					//printbuf("CMD ", cmd, sizeof(cmd));
-					memset(cmdresult, 0, sizeof(cmdresult));
-					size_t resultsize = 0;
-					
-					//printf("page start %x end %x\n", cmd[1], cmd[2]);
-					resultsize = NTAG_FAST_READ_PAGE_COUNT*NTAG_PAGE_SIZE;
-					
-					ret = DnfcSendTagCommand(cmd, sizeof(cmd), cmdresult, sizeof(cmdresult), &resultsize, NFC_TIMEOUT);
-					if(R_FAILED(ret)) {
-						printf("nfcSendTagCommand() failed: 0x%08x.\n", (unsigned int)ret);
-						break;
-					}
-					if (resultsize < NTAG_FAST_READ_PAGE_COUNT * NTAG_PAGE_SIZE) {
-						printf("Read size mismatch expected %d got %d.\n", NTAG_FAST_READ_PAGE_COUNT * NTAG_PAGE_SIZE, resultsize);
-						ret = -1;
-						break;
-					}
-
-					int copycount = sizeof(cmdresult);
-					if (((i * NTAG_PAGE_SIZE) + sizeof(cmdresult)) > sizeof(tagdata))
-						copycount = ((i * NTAG_PAGE_SIZE) + sizeof(cmdresult)) - sizeof(tagdata);
-					memcpy(&tagdata[i * NTAG_PAGE_SIZE], cmdresult, copycount);
-					//printbuf("result", cmdresult, resultsize); 
-				}
-				if (ret == 0) {
-					memcpy(data, tagdata, sizeof(tagdata));
-					//printbuf("result full ", tagdata, AMIIBO_MAX_SIZE);
-				}
-				break;
-			}
-		}
+		chunk = checkHeader;
+		userdata = &check;
 	}
-	uiUpdateProgress(0, -1);
-	printf("\n");
-	DnfcStopScanning();
+	
+	uiUpdateStatus("Reading.");
+	printf("Reading tag\n");
+	u8 tagdata[AMIIBO_MAX_SIZE];
+	memset(tagdata, 0, sizeof(tagdata));
+	int firstPages = chunk ? NFC_SEED_PAGES : NTAG_215_LAST_PAGE + 1;
+	ret = fastRead(0x00, firstPages, tagdata, chunk, userdata);
+	if (ret == 0 && firstPages <= NTAG_215_LAST_PAGE)
+		ret = fastRead(firstPages, NTAG_215_LAST_PAGE + 1 - firstPages, tagdata, chunk, userdata);
+	if (ret == 0)
+		memcpy(data, tagdata, datalen < sizeof(tagdata) ? datalen : sizeof(tagdata));
+	
+	stopScan();
 	return ret;
 }
 
@@ -169,57 +264,108 @@ Result nfc_readBlock(int pageId, u8 *data, int datalen) {
 	
 	memset(data, 0, datalen);
 
-	NFC_TagState prevstate, curstate;
-
-	ret = DnfcStartOtherTagScanning(NFC_STARTSCAN_DEFAULTINPUT, 0x01);
-	if(R_FAILED(ret)) {
-		printf("StartOtherTagScanning() failed.\n");
+	ret = waitForTag();
+	if (R_FAILED(ret))
 		return ret;
+	
+	u8 cmd[] = CMD_READ(pageId);
+	size_t resultsize = 0;
+	ret = DnfcSendTagCommand(cmd, sizeof(cmd), data, datalen, &resultsize, NFC_TIMEOUT);
+	if(R_FAILED(ret)) {
+		printf("nfcSendTagCommand() failed: 0x%08x.\n", (unsigned int)ret);
+	} else if (resultsize < NTAG_BLOCK_SIZE) {
+		printf("Read size mismatch expected %d got %d.\n", NTAG_BLOCK_SIZE, resultsize);
+		ret = -1;
 	}
+	
+	stopScan();
+	return ret;
+}
 
-	prevstate = NFC_TagState_Uninitialized;
-	while (1) {
-		gspWaitForVBlank();
-		hidScanInput();
+static int rttKind(u8 *cmd) {
+	return cmd[0] == 0x3A || cmd[0] == 0x30 ? RTT_KIND_READ : RTT_KIND_OTHER;
+}
 
-		u32 kDown = hidKeysDown();
-		
-		if(kDown & KEY_B) {
-			ret = -1;
-			printf("Cancelled.\n");
-			break;
+static void recordRtt(int kind, u64 us, size_t bytes) {
+	rttSamples[kind][rttNext[kind]].us = us;
+	rttSamples[kind][rttNext[kind]].bytes = bytes;
+	rttNext[kind] = (rttNext[kind] + 1) % NFC_RTT_SAMPLES;
+	if (rttCount[kind] < NFC_RTT_SAMPLES)
+		rttCount[kind]++;
+}
+
+//in microseconds. A sample from a shorter reply is scaled up to expectSize, never down
+static u64 adaptiveTimeout(int kind, size_t expectSize) {
+	if (rttCount[kind] < NFC_RTT_MIN_SAMPLES)
+		return NFC_TIMEOUT;
+	u64 slowest = 0;
+	for (int i = 0; i < rttCount[kind]; i++) {
+		rttSample *sample = &rttSamples[kind][i];
+		u64 us = sample->us;
+		if (sample->bytes > 0 && expectSize > sample->bytes)
+			us = us * expectSize / sample->bytes;
+		if (us > slowest)
+			slowest = us;
+	}
+	u64 timeout = slowest * NFC_TIMEOUT_FACTOR;
+	if (timeout < NFC_TIMEOUT_MIN)
+		return NFC_TIMEOUT_MIN;
+	if (timeout > NFC_TIMEOUT)
+		return NFC_TIMEOUT;
+	return timeout;
+}
+
+/*
+sends a command, retrying up to retries times on failure, timeout, a reply shorter than expectSize
+or (with expectAck) a NAK. Each retry waits a little longer and gets more time.
+After a tag reset the authentication is gone, so it is redone before retrying, and a failed
+redo ends the retries with NFC_ERR_AUTH or the command's error. Returns NFC_ERR_NAK if the tag
+kept NAKing, NFC_ERR_TAG_REMOVED once the tag is seen to leave
+*/
+static Result transceive(u8 *cmd, int cmdlen, u8 *dest, int destlen, size_t *resultsize, size_t expectSize, int expectAck, int retries) {
+	int kind = rttKind(cmd);
+	u64 timeout = adaptiveTimeout(kind, expectSize);
+	u64 backoff = NFC_RETRY_BACKOFF;
+	Result ret;
+	for (int attempt = 0; ; attempt++) {
+		*resultsize = 0;
+		u64 start = svcGetSystemTick();
+		ret = DnfcSendTagCommand(cmd, cmdlen, dest, destlen, resultsize, timeout);
+		if (R_SUCCEEDED(ret)) {
+			recordRtt(kind, (svcGetSystemTick() - start) / (SYSCLOCK_ARM11 / 1000000), *resultsize);
+			if (*resultsize < expectSize)
+				ret = -1;
+			else if (expectAck && *resultsize >= 1 && dest[0] != NTAG_ACK)
+				ret = NFC_ERR_NAK;
+			else
+				return ret;
 		}
-		
-		ret = DnfcGetTagState(&curstate);
-		if(R_FAILED(ret))
-		{
-			printf("nfcGetTagState() failed.\n");
-			DnfcStopScanning();
-			return ret;
+		//no use retrying on a tag that has been taken away, the journal picks up from here
+		if (tagRemoved()) {
+			printf("Tag removed.\n");
+			return NFC_ERR_TAG_REMOVED;
 		}
+		if (attempt >= retries)
+			return ret;
 		
-		if(curstate!=prevstate) {
-			prevstate = curstate;
-			if(curstate==NFC_TagState_InRange) {
-				u8 cmd[] = CMD_READ(pageId);
-				size_t resultsize = 0;
-				ret = DnfcSendTagCommand(cmd, sizeof(cmd), data, datalen, &resultsize, NFC_TIMEOUT);
-				if(R_FAILED(ret)) {
-					printf("nfcSendTagCommand() failed: 0x%08x.\n", (unsigned int)ret);
-					break;
-				}
-				if (resultsize < NTAG_BLOCK_SIZE) {
-					printf("Read size mismatch expected %d got %d.\n", NTAG_BLOCK_SIZE, resultsize);
-					ret = -1;
-					break;
-				}
-				break;
+		lastWriteStats.retries++;
+		svcSleepThread(backoff);
+		backoff *= 2;
+		timeout = timeout * 2 > NFC_TIMEOUT ? NFC_TIMEOUT : timeout * 2;
+		
+		if (authActive) {
+			//a tag that takes the PWD answers with the two PACK bytes, anything shorter is a NAK.
+			//Without it every retry would just be NAKed, so give up with the real cause
+			u8 pwdcmd[] = CMD_AUTH(authPwd);
+			u8 packres[2];
+			size_t packsize = 0;
+			Result authret = DnfcSendTagCommand(pwdcmd, sizeof(pwdcmd), packres, sizeof(packres), &packsize, NFC_TIMEOUT);
+			if (R_FAILED(authret) || packsize != sizeof(packres)) {
+				printf("PWD auth before a retry failed: 0x%08x, %d bytes.\n", (unsigned int)authret, (int)packsize);
+				return R_FAILED(authret) ? authret : NFC_ERR_AUTH;
 			}
 		}
 	}
-	
-	DnfcStopScanning();
-	return ret;
 }
 
 static Result writePage(int pageId, u8 *data) {
@@ -228,94 +374,404 @@ static Result writePage(int pageId, u8 *data) {
 	u8 cmd[] = CMD_WRITE(pageId, data);
 	size_t resultsize = 0;
 	u8 buffer[100];
-	int ret = DnfcSendTagCommand(cmd, sizeof(cmd), buffer, sizeof(buffer), &resultsize, NFC_TIMEOUT);
-	if(R_FAILED(ret)) {
+	int ret = transceive(cmd, sizeof(cmd), buffer, sizeof(buffer), &resultsize, 0, 1, NFC_RETRY_COUNT);
+	if (ret == NFC_ERR_NAK) {
+		printf("Writing Tag page %d got a NAK %d\n", pageId, buffer[0]);
+		lastWriteStats.naks++;
+	} else if(R_FAILED(ret)) {
 		printf("Writing Tag page %d failed: 0x%08x.\n", pageId, (unsigned int)ret);
-	} else if (resultsize >=1 && buffer[0] != 0x0A)
-		printf("write page returned a NAK %d\n", buffer[0]);
+	}
+	lastWriteStats.pagesWritten++;
 	return ret;
 }
 
-static Result writeTag(u8 *data, u8 *PWD, u8 *PACK) {
-	//write normal pages
-	int ret = 0;
+/*
+reads pageCount pages into their place in image, a buffer holding the whole tag,
+with as few FAST_READs as the reader allows. Whole pages of a short reply are
+kept and only the rest is asked for again, with a smaller span if the span was
+still being probed. Each command that brings pages in is reported to chunk with
+the end of what has been read so far
+*/
+static Result fastRead(int startPage, int pageCount, u8 *image, nfc_readChunk chunk, void *userdata) {
+	u8 *dest = &image[startPage * NTAG_PAGE_SIZE];
+	while (pageCount > 0) {
+		if (fastReadLimit < NFC_FAST_READ_MAX_SPAN && fastReadStreak >= fastReadReprobe) {
+			fastReadLimit = NFC_FAST_READ_MAX_SPAN;
+			fastReadStreak = 0;
+			if (fastReadReprobe < NFC_FAST_READ_REPROBE_MAX)
+				fastReadReprobe *= 2;
+		}
+		int span = fastReadGood < fastReadLimit ? (fastReadGood + fastReadLimit + 1) / 2 : fastReadLimit;
+		int count = pageCount < span ? pageCount : span;
+		int probing = count > fastReadGood;
+		u8 cmd[] = CMD_FAST_READ(startPage, count);
+		size_t resultsize = 0;
+		Result ret = transceive(cmd, sizeof(cmd), dest, count * NTAG_PAGE_SIZE, &resultsize, count * NTAG_PAGE_SIZE, 0, probing ? 0 : NFC_RETRY_COUNT);
+		
+		int got = resultsize / NTAG_PAGE_SIZE;
+		if (got > count)
+			got = count;
+		if (R_SUCCEEDED(ret)) {
+			fastReadStreak++;
+			if (count > fastReadGood) {
+				fastReadGood = count;
+				fastReadReprobe = NFC_FAST_READ_REPROBE;
+			}
+		} else if (ret == NFC_ERR_TAG_REMOVED) {
+			return ret;
+		} else if (count == 1 && got == 0) {
+			printf("Reading page 0x%02x failed: 0x%08x.\n", startPage, (unsigned int)ret);
+			return ret;
+		} else {
+			//a reader that truncates tells us its limit, one that errors gets bisected. A span
+			//that kept failing despite the retries is not known good any more
+			int limit = got > 0 ? got : count - 1;
+			fastReadStreak = 0;
+			if (!probing)
+				fastReadGood = got > 0 ? got : count / 2;
+			fastReadLimit = limit > fastReadGood ? limit : fastReadGood;
+		}
+		startPage += got;
+		pageCount -= got;
+		dest += got * NTAG_PAGE_SIZE;
+		if (chunk && got > 0) {
+			Result stop = chunk(image, startPage * NTAG_PAGE_SIZE, userdata);
+			if (stop != 0)
+				return stop;
+		}
+	}
+	return 0;
+}
+
+/*
+asks the tag what it is. One that answers as anything but an NTAG215 is no amiibo,
+one that does not answer is left to checkHeader
+*/
+static Result checkVersion() {
+	u8 cmd[] = CMD_GET_VERSION;
+	u8 version[NTAG_VERSION_SIZE];
+	size_t resultsize = 0;
+	if (R_FAILED(transceive(cmd, sizeof(cmd), version, sizeof(version), &resultsize, sizeof(version), 0, 0)))
+		return 0;
+	
+	if (version[1] == NTAG_VERSION_VENDOR_NXP && version[2] == NTAG_VERSION_TYPE_NTAG) {
+		if (version[6] == NTAG_VERSION_STORAGE_215)
+			return 0;
+		if (version[6] == NTAG_VERSION_STORAGE_213 || version[6] == NTAG_VERSION_STORAGE_216) {
+			printf("NTAG%d tag, amiibo are NTAG215.\n", version[6] == NTAG_VERSION_STORAGE_213 ? 213 : 216);
+			return NFC_ERR_NOT_AMIIBO;
+		}
+	}
+	printf("Not an NTAG215 (version %02x %02x %02x).\n", version[1], version[2], version[6]);
+	return NFC_ERR_NOT_AMIIBO;
+}
+
+//stops the read if the first pages lack the lock and CC bytes every amiibo has, see tag_isValid
+static Result checkHeader(u8 *data, int size, void *userdata) {
+	headerCheck *check = userdata;
+	if (!check->checked && size >= NFC3D_AMIIBO_HEADER_SIGNATURE_SIZE) {
+		check->checked = 1;
+		if (!nfc3d_amiibo_has_header_signature(data)) {
+			printf("Not an amiibo, stopped reading.\n");
+			return NFC_ERR_NOT_AMIIBO;
+		}
+	}
+	return check->chunk ? check->chunk(data, size, check->userdata) : 0;
+}
+
+//appends the ids of pages first..last whose content in current differs from data, all of them if current is NULL
+static int changedPages(int first, int last, u8 *current, u8 *data, u8 *pages, int count) {
+	for(int pageId = first; pageId <= last; pageId++) {
+		if (!current || memcmp(&current[pageId * NTAG_PAGE_SIZE], &data[pageId * NTAG_PAGE_SIZE], NTAG_PAGE_SIZE))
+			pages[count++] = pageId;
+	}
+	return count;
+}
+
+//the pages a restore writes, everything else is fixed once the tag is an amiibo
+static const int restoreRanges[][2] = {{0x04, 0x0C}, {0x20, 0x81}};
+#define RESTORE_RANGE_COUNT (sizeof(restoreRanges) / sizeof(restoreRanges[0]))
+
+//the user pages a full write covers
+static const int userPages[][2] = {{0x04, 0x81}};
+
+/*
+reads the ranges back and rewrites the pages that do not match data, for up to
+rounds rounds. One bulk read per round, fails if pages still differ after the last
+*/
+static Result verifyPages(const int ranges[][2], int rangeCount, u8 *data, int rounds) {
+	u8 current[(NTAG_215_LAST_PAGE + 1) * NTAG_PAGE_SIZE];
+	u8 mismatched[NTAG_215_LAST_PAGE + 1];
+	for (int round = 0; ; round++) {
+		int count = 0;
+		for (int r = 0; r < rangeCount; r++) {
+			int first = ranges[r][0];
+			Result ret = fastRead(first, ranges[r][1] - first + 1, current, NULL, NULL);
+			if (R_FAILED(ret))
+				return ret;
+			count = changedPages(first, ranges[r][1], current, data, mismatched, count);
+		}
+		lastWriteStats.verifyMismatches += count;
+		if (count == 0)
+			return 0;
+		if (round >= rounds) {
+			printf("%d pages still wrong after %d rewrites\n", count, rounds);
+			return -1;
+		}
+		
+		printf("Rewriting %d mismatched pages\n", count);
+		lastWriteStats.verifyRounds++;
+		for (int i = 0; i < count; i++) {
+			//a NAKed data page shows up in the next round
+			Result ret = writePage(mismatched[i], &data[mismatched[i] * NTAG_PAGE_SIZE]);
+			if (R_FAILED(ret) && ret != NFC_ERR_NAK)
+				return ret;
+		}
+	}
+}
+
+static void journalSave(writeJournal *journal) {
+	if (writeFile(NFC_JOURNAL_PATH, (u8 *)journal, sizeof(*journal)) < 0)
+		printf("Could not save write journal\n");
+}
+
+static void journalClear() {
+	remove(NFC_JOURNAL_PATH);
+}
+
+/*
+fills journal for writing data. Returns 1 if the journal on SD is for the same
+image, in which case its progress is kept
+*/
+static int journalLoad(writeJournal *journal, u8 *data) {
+	u8 hash[32];
+	mbedtls_sha256(data, NFC_JOURNAL_IMAGE_SIZE, hash, 0);
+	
+	if (readFile(NFC_JOURNAL_PATH, (u8 *)journal, sizeof(*journal)) == sizeof(*journal) &&
+			journal->magic == NFC_JOURNAL_MAGIC && !memcmp(journal->imageHash, hash, sizeof(hash)))
+		return 1;
+	
+	memset(journal, 0, sizeof(*journal));
+	journal->magic = NFC_JOURNAL_MAGIC;
+	memcpy(journal->imageHash, hash, sizeof(hash));
+	return 0;
+}
+
+/*
+writes the pages of ranges that differ from what the tag holds, then reads them
+back. Progress is journaled, so when the same image is written again after the
+tag was lifted only the pages from the first unacknowledged one on are looked
+at, the earlier ones just get read back. If the tag can not be read every page
+is written
+*/
+static Result writeDataPages(const int ranges[][2], int rangeCount, u8 *data, int fullWrite) {
+	writeJournal journal;
+	int resumePage = 0;
+	if (journalLoad(&journal, data) && journal.fullWrite == fullWrite && journal.nextPage > 0) {
+		resumePage = journal.nextPage;
+		if (resumePage == NFC_JOURNAL_DATA_DONE)
+			printf("Resuming interrupted write, data already written\n");
+		else
+			printf("Resuming interrupted write at page 0x%02x\n", resumePage);
+	} else {
+		journal.fullWrite = fullWrite;
+		journal.nextPage = 0;
+		journal.finalStep = 0;
+	}
+	
+	uiUpdateStatus("Reading tag");
+	printf("Reading tag\n");
+	u8 current[(NTAG_215_LAST_PAGE + 1) * NTAG_PAGE_SIZE];
+	int haveCurrent = 1;
+	int pageCount = 0;
+	for (int r = 0; r < rangeCount; r++) {
+		int first = ranges[r][0] > resumePage ? ranges[r][0] : resumePage;
+		if (first > ranges[r][1])
+			continue;
+		pageCount += ranges[r][1] - first + 1;
+		if (haveCurrent && R_FAILED(fastRead(first, ranges[r][1] - first + 1, current, NULL, NULL))) {
+			printf("Could not read tag, writing all pages\n");
+			haveCurrent = 0;
+		}
+	}
+	
+	u8 changed[NTAG_215_LAST_PAGE + 1];
+	int changedCount = 0;
+	for (int r = 0; r < rangeCount; r++) {
+		int first = ranges[r][0] > resumePage ? ranges[r][0] : resumePage;
+		changedCount = changedPages(first, ranges[r][1], haveCurrent ? current : NULL, data, changed, changedCount);
+	}
 	
-	int stepCount = 132;
 	int step = 0;
-	uiUpdateStatus("Writing normal pages");
-	uiUpdateProgress(step++, stepCount);
-	printf("Writing normal pages\n");
-	for(int pageId = 0x04; pageId <= 0x81; pageId++) {
-		uiUpdateProgress(step++, stepCount);
-		ret = writePage(pageId, &data[pageId * NTAG_PAGE_SIZE]);
-		if (R_FAILED(ret))
+	uiUpdateStatus("Writing data pages");
+	uiUpdateProgress(step, changedCount);
+	printf("Writing %d of %d pages\n", changedCount, pageCount);
+	for(int i = 0; i < changedCount; i++) {
+		//a NAKed data page is left to the readback, which rewrites it or fails the write
+		Result ret = writePage(changed[i], &data[changed[i] * NTAG_PAGE_SIZE]);
+		if (R_FAILED(ret) && ret != NFC_ERR_NAK) {
+			journalSave(&journal);
 			return ret;
+		}
+		journal.nextPage = changed[i] + 1;
+		if ((i + 1) % NFC_JOURNAL_SAVE_INTERVAL == 0)
+			journalSave(&journal);
+		uiUpdateProgress(++step, changedCount);
 	}
-	printf("\n");
 	
-	//write OTP
-	printf("Writing OTP\n");
-	uiUpdateStatus("Writing OTP");
-	uiUpdateProgress(step++, stepCount);
-	ret = writePage(0x03, &data[0x03 * NTAG_PAGE_SIZE]);
-	if (R_FAILED(ret))
-		return ret;
+	//skipped pages, and those written before an interruption, were only compared against one read
+	if (verifyRounds > 0 || changedCount < pageCount || resumePage > 0) {
+		printf("Verifying\n");
+		uiUpdateStatus("Verifying");
+		Result ret = verifyPages(ranges, rangeCount, data, verifyRounds > 0 ? verifyRounds : 1);
+		if (R_FAILED(ret)) {
+			journalSave(&journal);
+			return ret;
+		}
+	}
+	
+	journal.nextPage = NFC_JOURNAL_DATA_DONE;
+	journalSave(&journal);
+	return 0;
+}
 
-	ret = nfcCmd21(); //seems to put the NFC reader into a continious mode allowing all the requests to go through one session without powering the tag down.
-	if(R_FAILED(ret)) {
-		printf("nfcCmd21 failed: 0x%08x.\n", (unsigned int)ret);
+/*
+the data of a full write that was lifted during its final steps is all on the
+tag already, and the tag may look locked. Finish it as a full write so the lock
+bits and CFG pages all get written
+*/
+static int journalWantsFullWrite(u8 *data) {
+	writeJournal journal;
+	return journalLoad(&journal, data) && journal.fullWrite && journal.nextPage == NFC_JOURNAL_DATA_DONE;
+}
+
+/*
+reads back the lock and CFG pages writeTag wrote, only the bytes a write can set.
+Returns -1 if any of them did not take
+*/
+static Result verifyLockPages(u8 *data, u8 *dynamiclock, u8 *config1, u8 *config2) {
+	u8 current[(NTAG_215_LAST_PAGE + 1) * NTAG_PAGE_SIZE];
+	Result ret = fastRead(0x02, 1, current, NULL, NULL);
+	if (R_SUCCEEDED(ret))
+		ret = fastRead(0x82, 3, current, NULL, NULL);
+	if (R_FAILED(ret)) {
+		printf("Reading back lock pages failed: 0x%08x.\n", (unsigned int)ret);
 		return ret;
 	}
+	
+	//page 2 starts with UID bytes and 0x82 ends in an RFUI byte, neither can be written
+	if (memcmp(&current[0x02 * NTAG_PAGE_SIZE + 2], &data[0x02 * NTAG_PAGE_SIZE + 2], 2) ||
+			memcmp(&current[0x82 * NTAG_PAGE_SIZE], dynamiclock, 3) ||
+			memcmp(&current[0x83 * NTAG_PAGE_SIZE], config1, NTAG_PAGE_SIZE) ||
+			memcmp(&current[0x84 * NTAG_PAGE_SIZE], config2, NTAG_PAGE_SIZE)) {
+		printf("Lock or CFG pages did not take\n");
+		return -1;
+	}
+	return 0;
+}
 
-	//write PACK
-	printf("Writing PACK\n");
-	uiUpdateStatus("Writing PACK");
-	uiUpdateProgress(step++, stepCount);
-	ret = writePage(0x86, PACK);
-	if (R_FAILED(ret))
-		return ret;
+/*
+writes a blank tag. A factory fresh tag reads as zeros, so the user pages are
+read first and only the ones that differ are written. Lock bits and CFG pages
+go last, only once every data page has been read back. Each of those steps is
+journaled, and a resume past the PWD step authenticates first, as CFG0 may
+already protect the tag
+*/
+static Result writeTag(u8 *data, u8 *PWD, u8 *PACK) {
+	writeJournal journal;
+	int firstStep = 0;
+	if (journalLoad(&journal, data) && journal.fullWrite && journal.nextPage == NFC_JOURNAL_DATA_DONE)
+		firstStep = journal.finalStep;
 	
-	//write PWD
-	printf("Writing PWD\n");
-	uiUpdateStatus("Writing PWD");
-	ret = writePage(0x85, PWD);
-	uiUpdateProgress(step++, stepCount);
-	if (R_FAILED(ret))
-		return ret;
+	int ret = 0;
+	int continuous = 0;
+	if (firstStep > FINAL_PWD) {
+		ret = nfcCmd21(); //seems to put the NFC reader into a continious mode allowing all the requests to go through one session without powering the tag down.
+		if(R_FAILED(ret)) {
+			printf("nfcCmd21 failed: 0x%08x.\n", (unsigned int)ret);
+			return ret;
+		}
+		continuous = 1;
+		uiUpdateStatus("Authenticating");
+		printf("Resuming after the PWD was written, authenticating\n");
+		ret = nfc_auth(PWD);
+		if (R_FAILED(ret))
+			return ret;
+	}
 	
-	uiUpdateStatus("Writing lock bits");
-	//write LOCK
-	printf("Writing lock bits");
-    
-	printf(".");
-	uiUpdateProgress(step++, stepCount);
-	//tag.writePage(2, new byte[]{pages[2 * TagUtil.PAGE_SIZE], pages[(2 * TagUtil.PAGE_SIZE) + 1], (byte) 0x0F, (byte) 0xE0}); //lock bits	
-	ret = writePage(0x02, &data[0x02 * NTAG_PAGE_SIZE]); //static lock bits
+	//write normal pages
+	ret = writeDataPages(userPages, 1, data, 1);
 	if (R_FAILED(ret))
 		return ret;
+	journalLoad(&journal, data);
 	
-	printf(".");
-	uiUpdateProgress(step++, stepCount);
 	u8 dynamiclock[] = {0x01, 0x00, 0x0F, 0x00}; //dynamic lock bits.
-	ret = writePage(0x82, dynamiclock);
-	if (R_FAILED(ret))
-		return ret;
-
-	printf(".");
-	uiUpdateProgress(step++, stepCount);
 	u8 config1[] = {0x00, 0x00, 0x00, 0x04}; //config
-	ret = writePage(0x83, config1);
-	if (R_FAILED(ret))
-		return ret;
-	
-	printf(".");
-	uiUpdateProgress(step++, stepCount);
 	u8 config2[] = {0x5F, 0x00, 0x00, 0x00}; //config
-	ret = writePage(0x84, config2);
-	if (R_FAILED(ret))
-		return ret;
 	
-	printf("\n");
+	for (int step = firstStep; step < FINAL_STEP_COUNT; step++) {
+		uiUpdateProgress(step, FINAL_STEP_COUNT);
+		if (step >= FINAL_PACK && !continuous) {
+			ret = nfcCmd21();
+			if(R_FAILED(ret)) {
+				printf("nfcCmd21 failed: 0x%08x.\n", (unsigned int)ret);
+				break;
+			}
+			continuous = 1;
+		}
+		
+		switch (step) {
+		case FINAL_OTP:
+			printf("Writing OTP\n");
+			uiUpdateStatus("Writing OTP");
+			ret = writePage(0x03, &data[0x03 * NTAG_PAGE_SIZE]);
+			break;
+		case FINAL_PACK:
+			printf("Writing PACK\n");
+			uiUpdateStatus("Writing PACK");
+			ret = writePage(0x86, PACK);
+			break;
+		case FINAL_PWD:
+			printf("Writing PWD\n");
+			uiUpdateStatus("Writing PWD");
+			ret = writePage(0x85, PWD);
+			break;
+		case FINAL_STATIC_LOCK:
+			printf("Writing lock bits\n");
+			uiUpdateStatus("Writing lock bits");
+			//tag.writePage(2, new byte[]{pages[2 * TagUtil.PAGE_SIZE], pages[(2 * TagUtil.PAGE_SIZE) + 1], (byte) 0x0F, (byte) 0xE0}); //lock bits	
+			ret = writePage(0x02, &data[0x02 * NTAG_PAGE_SIZE]); //static lock bits
+			break;
+		case FINAL_DYNAMIC_LOCK:
+			ret = writePage(0x82, dynamiclock);
+			break;
+		case FINAL_CFG0:
+			printf("Writing CFG pages\n");
+			uiUpdateStatus("Writing CFG pages");
+			ret = writePage(0x83, config1);
+			break;
+		case FINAL_CFG1:
+			ret = writePage(0x84, config2);
+			break;
+		}
+		if (R_FAILED(ret))
+			break;
+		journal.finalStep = step + 1;
+		journalSave(&journal);
+	}
+	
+	if (R_SUCCEEDED(ret))
+		ret = verifyLockPages(data, dynamiclock, config1, config2);
+	if (R_FAILED(ret)) {
+		//lock and CFG writes are redone on the next try, with authentication as the PWD is on the tag
+		if (journal.finalStep > FINAL_STATIC_LOCK) {
+			journal.finalStep = FINAL_STATIC_LOCK;
+			journalSave(&journal);
+		}
+		return ret;
+	}
+	uiUpdateProgress(FINAL_STEP_COUNT, FINAL_STEP_COUNT);
+	journalClear();
 
 	ret = nfcCmd22(); //power down the tag
 	if(R_FAILED(ret)) {  //not a critical error
@@ -325,6 +781,9 @@ static Result writeTag(u8 *data, u8 *PWD, u8 *PACK) {
 	return 0;
 }
 
+/*
+restores game data, writing only the pages that differ from what the tag holds
+*/
 static Result restoreTag(u8 *data, u8 *PWD) {
 	//write normal pages
 	int ret = 0;
@@ -340,23 +799,10 @@ static Result restoreTag(u8 *data, u8 *PWD) {
 	if (R_FAILED(ret))
 		return ret;
 	
-	int stepCount = 107;
-	int step = 0;
-	uiUpdateStatus("Writing data pages");
-	uiUpdateProgress(step++, stepCount);
-	printf("Writing normal pages\n");
-	for(int pageId = 0x04; pageId <= 0x0C; pageId++) {
-		uiUpdateProgress(step++, stepCount);
-		ret = writePage(pageId, &data[pageId * NTAG_PAGE_SIZE]);
-		if (R_FAILED(ret))
-			return ret;
-	}
-	for(int pageId = 0x20; pageId <= 0x81; pageId++) {
-		uiUpdateProgress(step++, stepCount);
-		ret = writePage(pageId, &data[pageId * NTAG_PAGE_SIZE]);
-		if (R_FAILED(ret))
-			return ret;
-	}
+	ret = writeDataPages(restoreRanges, RESTORE_RANGE_COUNT, data, 0);
+	if (R_FAILED(ret))
+		return ret;
+	journalClear();
 	
 	ret = nfcCmd22(); //power down the tag
 	if(R_FAILED(ret)) { //not a critical error
@@ -370,7 +816,8 @@ static Result nfc_auth(u8 *PWD) {
 	u8 pwdcmd[] = CMD_AUTH(PWD); //auth
 	size_t resultsize = 0;
 	u8 packres[2];
-	int ret = DnfcSendTagCommand(pwdcmd, sizeof(pwdcmd), packres, sizeof(packres), &resultsize, NFC_TIMEOUT);
+	authActive = 0;
+	int ret = transceive(pwdcmd, sizeof(pwdcmd), packres, sizeof(packres), &resultsize, sizeof(packres), 0, NFC_RETRY_COUNT);
 	//printbuf("pack ", packres, sizeof(packres));
 	if(R_FAILED(ret)) {
 		printf("PWD command failed: 0x%08x.\n", (unsigned int)ret);
@@ -382,57 +829,216 @@ static Result nfc_auth(u8 *PWD) {
 		return -1;
 	}
 	
+	memcpy(authPwd, PWD, sizeof(authPwd));
+	authActive = 1;
 	return 0;
 }
 
+void nfc_setVerifyRounds(int rounds) {
+	verifyRounds = rounds < 0 ? 0 : rounds;
+}
+
+void nfc_getWriteStats(nfc_writeStats *stats) {
+	*stats = lastWriteStats;
+}
+
 Result nfc_write(u8 *data, int datalen, u8 *PWD, int PWDLength, int fullWrite) {
 	if (datalen < NTAG_PAGE_SIZE * 0x81) return -1;
 	if (PWDLength != NTAG_PAGE_SIZE) return -1;
+	memset(&lastWriteStats, 0, sizeof(lastWriteStats));
+	authActive = 0;
 	
-	Result ret=0;
+	Result ret = waitForTag();
+	if (R_FAILED(ret))
+		return ret;
 	
-	NFC_TagState prevstate, curstate;
+	u8 PACK[] = NTAG_PACK;
+	if (fullWrite || journalWantsFullWrite(data))
+		ret = writeTag(data, PWD, PACK);
+	else
+		ret = restoreTag(data, PWD);
+	
+	stopScan();
+	printf("\n");
+	return ret;
+}
 
-	ret = DnfcStartOtherTagScanning(NFC_STARTSCAN_DEFAULTINPUT, 0x01);
+/*
+starts scanning and waits until a tag is in range. On success scanning is left
+running for the caller to stop
+*/
+static Result waitForTag() {
+	Result ret = startScan();
 	if(R_FAILED(ret)) {
 		printf("StartOtherTagScanning() failed: 0x%08x.\n", (unsigned int)ret);
 		return ret;
 	}
 
-	prevstate = NFC_TagState_Uninitialized;
 	while (1) {
-		gspWaitForVBlank();
+		tagEvent event;
+		if (nextTagEvent(&event, NFC_CANCEL_POLL)) {
+			if(R_FAILED(event.result)) {
+				printf("nfcGetTagState() failed: 0x%08x.\n", (unsigned int)event.result);
+				stopScan();
+				return event.result;
+			}
+			if(event.state==NFC_TagState_InRange)
+				return 0;
+			continue;
+		}
+		
 		hidScanInput();
-
 		u32 kDown = hidKeysDown();
 		
 		if(kDown & KEY_B) {
-			ret = -1;
 			printf("Cancelled.\n");
+			stopScan();
+			return -1;
+		}
+	}
+}
+
+/*
+the detection thread. Looks at the tag state whenever a range event fires, or
+every NFC_DETECT_POLL, and queues each change
+*/
+static void detectTags(void *arg) {
+	int scan = -1;
+	NFC_TagState last = NFC_TagState_Uninitialized;
+	while (1) {
+		LightEvent_Wait(&scanArmed);
+		if (detectQuit)
 			break;
+		if (scan != scanGeneration) {
+			scan = scanGeneration;
+			last = NFC_TagState_Uninitialized;
 		}
 		
-		ret = DnfcGetTagState(&curstate);
-		if(R_FAILED(ret)) {
-			printf("nfcGetTagState() failed: 0x%08x.\n", (unsigned int)ret);
-			DnfcStopScanning();
-			return ret;
+		s32 fired = -1;
+		if (rangeEvents[0] && rangeEvents[1])
+			svcWaitSynchronizationN(&fired, rangeEvents, 2, false, NFC_DETECT_POLL);
+		else
+			svcSleepThread(NFC_DETECT_POLL);
+		if (!scanning)
+			continue;
+		
+		tagEvent event;
+		event.scan = scan;
+		event.result = DnfcGetTagState(&event.state);
+		if (R_SUCCEEDED(event.result) && event.state == last) {
+			//an event that stays signalled must not turn this into a busy loop
+			if (fired >= 0)
+				svcSleepThread(NFC_DETECT_POLL);
+			continue;
 		}
+		last = R_SUCCEEDED(event.result) ? event.state : NFC_TagState_Uninitialized;
 		
-		if(curstate!=prevstate) {
-			prevstate = curstate;
-			if(curstate==NFC_TagState_InRange) {
-				u8 PACK[] = NTAG_PACK;
-				if (fullWrite)
-					ret = writeTag(data, PWD, PACK);
-				else
-					ret = restoreTag(data, PWD);
-				break;
-			}
+		LightLock_Lock(&queueLock);
+		if (queueCount == NFC_EVENT_QUEUE_SIZE) { //drop the oldest, the latest state is what matters
+			queueHead = (queueHead + 1) % NFC_EVENT_QUEUE_SIZE;
+			queueCount--;
+		}
+		eventQueue[(queueHead + queueCount) % NFC_EVENT_QUEUE_SIZE] = event;
+		queueCount++;
+		LightEvent_Signal(&queueSignal);
+		LightLock_Unlock(&queueLock);
+	}
+}
+
+/*
+takes the oldest event of the current scan off the queue, waiting up to timeout
+for one. Returns 0 if none came
+*/
+static int nextTagEvent(tagEvent *event, s64 timeout) {
+	for (int waited = 0; ; waited = 1) {
+		int found = 0;
+		LightLock_Lock(&queueLock);
+		while (queueCount > 0 && !found) {
+			*event = eventQueue[queueHead];
+			queueHead = (queueHead + 1) % NFC_EVENT_QUEUE_SIZE;
+			queueCount--;
+			found = event->scan == scanGeneration;
 		}
+		if (queueCount == 0)
+			LightEvent_Clear(&queueSignal);
+		LightLock_Unlock(&queueLock);
+		
+		if (found) {
+			if (R_SUCCEEDED(event->result))
+				lastTagState = event->state;
+			return 1;
+		}
+		if (waited || timeout <= 0)
+			return 0;
+		LightEvent_WaitTimeout(&queueSignal, timeout);
 	}
+}
+
+//whether the detection thread has seen the tag leave since the scan found it
+static int tagRemoved() {
+	tagEvent event;
+	while (nextTagEvent(&event, 0))
+		;
+	return lastTagState == NFC_TagState_OutOfRange;
+}
+
+static Result startScan() {
+	LightLock_Lock(&queueLock);
+	scanGeneration++;
+	queueCount = 0;
+	lastTagState = NFC_TagState_Uninitialized;
+	LightEvent_Clear(&queueSignal);
+	LightLock_Unlock(&queueLock);
 	
+	Result ret = DnfcStartOtherTagScanning(NFC_STARTSCAN_DEFAULTINPUT, 0x01);
+	if (R_SUCCEEDED(ret)) {
+		scanning = 1;
+		LightEvent_Signal(&scanArmed);
+	}
+	return ret;
+}
+
+static void stopScan() {
+	scanning = 0;
+	LightEvent_Clear(&scanArmed);
 	DnfcStopScanning();
+}
+
+/*
+reads the first pages, lets prepare produce the data and password for this
+tag, then writes it, all while the tag stays in range
+*/
+Result nfc_writeSession(u8 *data, int datalen, u8 *PWD, int PWDLength, nfc_prepareWrite prepare, void *userdata) {
+	if (datalen < NTAG_PAGE_SIZE * 0x81) return -1;
+	if (PWDLength != NTAG_PAGE_SIZE) return -1;
+	memset(&lastWriteStats, 0, sizeof(lastWriteStats));
+	authActive = 0;
+	
+	Result ret = waitForTag();
+	if (R_FAILED(ret))
+		return ret;
+	
+	uiUpdateStatus("Tag detected.");
+	u8 firstPages[NTAG_BLOCK_SIZE];
+	u8 cmd[] = CMD_READ(0);
+	size_t resultsize = 0;
+	ret = transceive(cmd, sizeof(cmd), firstPages, sizeof(firstPages), &resultsize, NTAG_BLOCK_SIZE, 0, NFC_RETRY_COUNT);
+	if(R_FAILED(ret))
+		printf("Reading the UID failed: 0x%08x.\n", (unsigned int)ret);
+	
+	int fullWrite = 0;
+	if (ret == 0)
+		ret = prepare(firstPages, sizeof(firstPages), data, datalen, PWD, &fullWrite, userdata);
+	
+	if (ret == 0) {
+		u8 PACK[] = NTAG_PACK;
+		if (fullWrite || journalWantsFullWrite(data))
+			ret = writeTag(data, PWD, PACK);
+		else
+			ret = restoreTag(data, PWD);
+	}
+	
+	stopScan();
 	printf("\n");
 	return ret;
 }
@@ -443,8 +1049,43 @@ int nfc_init() {
 		printf("nfcInit() failed: 0x%08x.\n", (unsigned int)ret);
 		return 0;
 	}
+	
+	LightLock_Init(&queueLock);
+	LightEvent_Init(&queueSignal, RESET_STICKY);
+	LightEvent_Init(&scanArmed, RESET_STICKY);
+	if (R_FAILED(nfcGetTagInRangeEvent(&rangeEvents[0])) || R_FAILED(nfcGetTagOutOfRangeEvent(&rangeEvents[1])))
+		closeRangeEvents();
+	
+	//above the main thread, so a change is seen while it is busy
+	s32 prio = 0x30;
+	svcGetThreadPriority(&prio, CUR_THREAD_HANDLE);
+	detectQuit = 0;
+	detectThread = threadCreate(detectTags, NULL, NFC_DETECT_STACK_SIZE, prio > 0x18 ? prio - 1 : prio, -2, false);
+	if (!detectThread) {
+		printf("Could not start tag detection.\n");
+		closeRangeEvents();
+		nfcExit();
+		return 0;
+	}
 	return 1;
 }
 void nfc_exit() {
+	if (detectThread) {
+		detectQuit = 1;
+		LightEvent_Signal(&scanArmed);
+		threadJoin(detectThread, U64_MAX);
+		threadFree(detectThread);
+		detectThread = NULL;
+	}
+	closeRangeEvents();
 	nfcExit();
 }
+
+//the event handles stay open until closed, also when only the first one was had
+static void closeRangeEvents() {
+	for (int i = 0; i < 2; i++) {
+		if (rangeEvents[i])
+			svcCloseHandle(rangeEvents[i]);
+		rangeEvents[i] = 0;
+	}
+}
@@ -10,9 +10,34 @@ extern "C" {
 #define NTAG_READ_PAGE_COUNT 4
 #define NTAG_BLOCK_SIZE NTAG_READ_PAGE_COUNT * NTAG_PAGE_SIZE
 
-Result nfc_readFull(u8 *data, int datalen);
+#define NFC_ERR_NOT_AMIIBO -3
+#define NFC_ERR_TAG_REMOVED -4
+#define NFC_ERR_AUTH -5 //the tag stopped taking the PWD partway through
+
+//called while nfc_readFull runs, each time more of the tag is in: data holds its first size bytes.
+//Returning anything but 0 stops the read, nfc_readFull then returns that
+typedef Result (*nfc_readChunk)(u8 *data, int size, void *userdata);
+
+//strict stops reading as soon as a tag shows it is no amiibo, with NFC_ERR_NOT_AMIIBO. chunk may be NULL
+Result nfc_readFull(u8 *data, int datalen, int strict, nfc_readChunk chunk, void *userdata);
 Result nfc_readBlock(int pageId, u8 *data, int datalen); //reads four pages
+//what the last nfc_write/nfc_writeSession did
+typedef struct {
+	int pagesWritten; //WRITE commands sent, rewrites included
+	int naks;
+	int retries; //commands sent again after a timeout, NAK or short reply
+	int verifyMismatches; //pages found wrong on readback, over all rounds
+	int verifyRounds; //rounds that had to rewrite something
+} nfc_writeStats;
+
 Result nfc_write(u8 *data, int datalen, u8 *PWD, int PWDLength, int fullWrite);
+void nfc_setVerifyRounds(int rounds); //readback rounds after a write, 0 disables
+void nfc_getWriteStats(nfc_writeStats *stats);
+
+//called by nfc_writeSession with the tag's first four pages. Fills data (tag format) and PWD for that tag,
+//sets fullWrite for a blank tag, and returns 0 to go ahead with the write
+typedef Result (*nfc_prepareWrite)(u8 *firstPages, int firstPagesLen, u8 *data, int datalen, u8 *PWD, int *fullWrite, void *userdata);
+Result nfc_writeSession(u8 *data, int datalen, u8 *PWD, int PWDLength, nfc_prepareWrite prepare, void *userdata); //uid read, prepare and write in one scan
 int nfc_init();
 void nfc_exit();
 
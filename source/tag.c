@@ -1,38 +1,51 @@
 #include "tag.h"
 
 #include "nfc3d/amitool.h"
+#include "nfc3d/amiibo.h"
 #include <stdio.h>
 #include <string.h>
 
-static u8 unpackedData[AMIIBO_MAX_SIZE]; //holds the data in internal (unpacked format)
-static int dataLength;
-static int amiiboLoaded = 0;
-static int keysLoaded = 0;
+//codes tag_setKeys/tag_setTag return as they come from thenaya, fails to compile if they drift apart
+typedef char tag_check_no_free_slot[TAG_ERR_NO_FREE_SLOT == THENAYA_ERR_NO_FREE_SLOT ? 1 : -1];
+typedef char tag_check_out_of_memory[TAG_ERR_OUT_OF_MEMORY == THENAYA_ERR_OUT_OF_MEMORY ? 1 : -1];
+
+//the tag_* functions work on a default context holding a single amiibo, see thenaya.h for more
+static thenaya_keys *defaultKeys = NULL;
+static thenaya_ctx *defaultCtx = NULL;
+static thenaya_amiibo *loadedAmiibo = NULL;
 
 int tag_setKeys(u8 *keybuffer, int size) {
-	if (keysLoaded) return TAG_ERR_OK;
-	if (amitool_setKeys(keybuffer, size) != 0) {
-		return TAG_ERR_INVALID_KEY;
+	if (defaultKeys) return TAG_ERR_OK;
+	int res = thenaya_keysCreate(&defaultKeys, keybuffer, size);
+	if (res != THENAYA_ERR_OK)
+		return res;
+	res = thenaya_ctxCreate(&defaultCtx, defaultKeys, 1);
+	if (res != THENAYA_ERR_OK) {
+		thenaya_keysDestroy(defaultKeys);
+		defaultKeys = NULL;
 	}
-	keysLoaded = 1;
-	return TAG_ERR_OK;
+	return res;
+}
+
+thenaya_keys *tag_getKeys() {
+	return defaultKeys;
 }
 
 int tag_isLoaded() {
-	return amiiboLoaded;
+	return loadedAmiibo != NULL;
 }
 
 int tag_isKeysLoaded() {
-	return keysLoaded;
+	return defaultKeys != NULL;
 }
 
 /*
-loads amiibo in tag format, but holds it in internal format
+loads amiibo in tag format, validating the signature bytes only. It is decrypted
+once something needs the plaintext (tag_verify, tag_setUid, tag_getTag)
 */
 int tag_setTag(u8 *data, int size) {
-	amiiboLoaded = 0;
-	memset(unpackedData, 0, AMIIBO_MAX_SIZE);
-	memcpy(unpackedData, data, size);
+	thenaya_amiiboClose(loadedAmiibo);
+	loadedAmiibo = NULL;
 
 	if (size > AMIIBO_MAX_SIZE)
 		return TAG_ERR_INVALID_SIZE;
@@ -40,20 +53,20 @@ int tag_setTag(u8 *data, int size) {
 	if (!tag_isValid(data, size))
 		return TAG_ERR_VALIDATION_FAILED;
 	
-	if (!keysLoaded)
+	if (!defaultCtx)
 		return TAG_KEY_NOT_LOADED;
 	
-	int res = amitool_unpack(data, size, unpackedData, AMIIBO_MAX_SIZE);
-	if (!res) {
-		return TAG_ERR_DECRYPT_FAIL;
-	}
-	
-	amiiboLoaded = 1;
-	dataLength = size;
-	return TAG_ERR_OK;
+	return thenaya_amiiboOpen(defaultCtx, data, size, &loadedAmiibo);
 }
 
-#define PAGED_BYTE(page, index) ((page *4) + index)
+/*
+decrypts the loaded amiibo if not done yet, fails if the HMACs do not match
+*/
+int tag_verify() {
+	if (!loadedAmiibo)
+		return TAG_ERR_NO_TAG_LOADED;
+	return thenaya_amiiboVerify(loadedAmiibo);
+}
 
 /*
 accepts the first 4 pages of a tag (tagformat) and returns true if the lock signature is correct
@@ -62,42 +75,15 @@ int tag_isLocked(u8 *data, int size) {
 	if (size < (4 * 4))
 		return 0;
 	
-	return (data[PAGED_BYTE(0x02, 2)] == 0x0F && data[PAGED_BYTE(0x02, 3)] == 0xE0);
+	return nfc3d_amiibo_has_lock_signature(data);
 }
 
 /*
 Validates if the data is an amiibo (expects tag format data)
 */
 int tag_isValid(u8 *data, int size) {
-	// must start with a 0x04.
-	if (data[0x0] != 0x04)
-		return 0;
-
-	//lock signature mismatch
-	if (data[PAGED_BYTE(0x02, 2)] != 0x0F || data[PAGED_BYTE(0x02, 3)] != 0xE0)
-		return 0;
-	
-	// CC signature mismatch.
-	if (data[PAGED_BYTE(0x03, 0)] != 0xF1 || data[PAGED_BYTE(0x03, 1)] != 0x10
-	 || data[PAGED_BYTE(0x03, 2)] != 0xFF || data[PAGED_BYTE(0x03, 3)] != 0xEE)
-		return 0;
-
-	//dynamic lock signature mismatch.
-	if (data[PAGED_BYTE(0x82, 0)] != 0x01 || data[PAGED_BYTE(0x82, 1)] != 0x0
-	 || data[PAGED_BYTE(0x82, 2)] != 0x0F)
-		return 0;
-
-	//CFG0 signature mismatch
-	if (data[PAGED_BYTE(0x83, 0)] != 0x00 || data[PAGED_BYTE(0x83, 1)] != 0x00
-	 || data[PAGED_BYTE(0x83, 2)] != 0x00 || data[PAGED_BYTE(0x83, 3)] != 0x04)
-		return 0;
-
-	//CFG1 signature mismatch
-	if (data[PAGED_BYTE(0x84, 0)] != 0x5F || data[PAGED_BYTE(0x84, 1)] != 0x00
-	 || data[PAGED_BYTE(0x84, 2)] != 0x00 || data[PAGED_BYTE(0x84, 3)] != 0x00)
-		return 0;
-
-	return 1;
+	// manufacturer, lock, CC, dynamic lock and CFG0/CFG1 signatures, see nfc3d/layout.h
+	return nfc3d_amiibo_has_signature(data);
 }
 
 /*
@@ -118,50 +104,18 @@ int tag_getUidFromBlock(u8 *data, int size, u8 *uid, int uidsize) {
 }
 
 int tag_setUid(u8* uid, int uidlen) {
-	//we handle both 7 byte uid and 9 byte uid (7+2 checksums)
-	if (!amiiboLoaded)
+	if (!loadedAmiibo)
 		return TAG_ERR_NO_TAG_LOADED;
-	if (uidlen == 7) {
-		u8 uid9[9];
-		uid9[0] = uid[0];
-		uid9[1] = uid[1];
-		uid9[2] = uid[2];
-		uid9[3] = 0x88 ^ uid[0] ^ uid[1] ^ uid[2];
-		uid9[4] = uid[3];
-		uid9[5] = uid[4];
-		uid9[6] = uid[5];
-		uid9[7] = uid[6];
-		uid9[8] = uid[3] ^ uid[4] ^ uid[5] ^ uid[6];
-		memcpy(&unpackedData[0x1d4], uid9, 8);
-		unpackedData[0] = uid9[8];
-	} else if (uidlen == 9) {
-		memcpy(&unpackedData[0x1d4], uid, 8);
-		unpackedData[0] = uid[8];
-	} else
-		return TAG_ERR_INVALID_BUFFER_SIZE;
-	
-	return TAG_ERR_OK;
+	return thenaya_amiiboSetUid(loadedAmiibo, uid, uidlen);
 }
 
 /*
 returns amiibo data in tag format
 */
 int tag_getTag(u8 *data, int size) {
-	if (!amiiboLoaded)
+	if (!loadedAmiibo)
 		return TAG_ERR_NO_TAG_LOADED;
-	if (size < dataLength)
-		return TAG_ERR_BUFFER_TOO_SMALL;
-	if (size > dataLength)
-		memset(data, 0, size);
-	
-	if (!keysLoaded)
-		return TAG_KEY_NOT_LOADED;
-	
-	int res = amitool_pack(unpackedData, dataLength, data, size);
-	if (!res) {
-		return TAG_ERR_ENCRYPT_FAIL;
-	}
-	return TAG_ERR_OK;
+	return thenaya_amiiboGetTag(loadedAmiibo, data, size);
 }
 
 int tag_calculatePassword(u8 *uid, int uidlen, u8 *pwd, int pwdlen) {
@@ -182,11 +136,11 @@ int tag_calculatePassword(u8 *uid, int uidlen, u8 *pwd, int pwdlen) {
 Returns character id bytes from tag format
 */
 int tag_charIdDataFromTag(u8 *data, int dataLen, u8 *charData, int charDataLen) {
-	if (dataLen < 0x5C)
+	if (dataLen < NFC3D_AMIIBO_CHAR_ID_TAG_POS + NFC3D_AMIIBO_CHAR_ID_SIZE)
 		return TAG_ERR_INVALID_SIZE;
 	if (charDataLen < TAG_CHAR_ID_LENGTH)
 		return TAG_ERR_BUFFER_TOO_SMALL;
-	memcpy(charData, &data[0x54], TAG_CHAR_ID_LENGTH);
+	memcpy(charData, nfc3d_amiibo_tag_char_id(data), TAG_CHAR_ID_LENGTH);
 	return TAG_ERR_OK;
 }
 
@@ -195,28 +149,16 @@ int tag_charIdDataFromTag(u8 *data, int dataLen, u8 *charData, int charDataLen)
 returns the char id bytes from loaded tag
 */
 int tag_getCharIdData(u8 *charData, int charDataLen) {
-	if (!amiiboLoaded)
+	if (!loadedAmiibo)
 		return TAG_ERR_NO_TAG_LOADED;
-	if (charDataLen < TAG_CHAR_ID_LENGTH)
-		return TAG_ERR_BUFFER_TOO_SMALL;
-	memcpy(charData, &unpackedData[0x1DC], TAG_CHAR_ID_LENGTH);
-	return TAG_ERR_OK;
+	return thenaya_amiiboGetCharIdData(loadedAmiibo, charData, charDataLen);
 }
 
 /*
 returns 7 byte uid from loaded tag
 */
 int tag_getUid7(u8 *uid, int uidlen) {
-	if (!amiiboLoaded)
+	if (!loadedAmiibo)
 		return TAG_ERR_NO_TAG_LOADED;
-	if (uidlen < 7)
-		return TAG_ERR_BUFFER_TOO_SMALL;
-	uid[0] = unpackedData[0x1D4];
-	uid[1] = unpackedData[0x1D5];
-	uid[2] = unpackedData[0x1D6];
-	uid[3] = unpackedData[0x1D8];
-	uid[4] = unpackedData[0x1D9];
-	uid[5] = unpackedData[0x1DA];
-	uid[6] = unpackedData[0x1DB];
-	return TAG_ERR_OK;
+	return thenaya_amiiboGetUid7(loadedAmiibo, uid, uidlen);
 }
\ No newline at end of file
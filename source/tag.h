@@ -1,6 +1,7 @@
 #pragma once
 
 #include <3ds.h>
+#include "thenaya.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -16,6 +17,8 @@ extern "C" {
 #define TAG_ERR_ENCRYPT_FAIL -7
 #define TAG_ERR_VALIDATION_FAILED -8
 #define TAG_KEY_NOT_LOADED -9
+#define TAG_ERR_NO_FREE_SLOT -10
+#define TAG_ERR_OUT_OF_MEMORY -11
 
 #define TAG_PWD_LEN 4
 
@@ -26,9 +29,11 @@ extern "C" {
 
 
 int tag_setKeys(u8 *keybuffer, int size);
+thenaya_keys *tag_getKeys(); //for creating more contexts with the loaded keys
 int tag_isLoaded();
 int tag_isKeysLoaded();
 int tag_setTag(u8 *data, int datalength);
+int tag_verify();
 int tag_isValid(u8 *data, int size);
 int tag_isLocked(u8 *data, int size);
 int tag_setUid(u8* uid, int uidlen);
@@ -0,0 +1,327 @@
+#include "thenaya.h"
+
+#include "nfc3d/amitool.h"
+#include "nfc3d/amiibo.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct thenaya_keys {
+	nfc3d_amiibo_preparedkeys prepared;
+};
+
+struct thenaya_amiibo {
+	LightLock lock;
+	thenaya_ctx *ctx;
+	thenaya_amiibo *nextFree;
+	int inUse;
+	int dataLength;
+	int unpacked; //UNPACK_* state, decryption only runs once something needs the plaintext
+	u8 tagData[AMIIBO_MAX_SIZE]; //the image as loaded, in tag format
+	u8 unpackedData[AMIIBO_MAX_SIZE]; //internal (unpacked) format, once unpacked
+	nfc3d_amiibo_session session; //keys and keystream of this dump, so writing it back skips keygen
+};
+
+//keygen runs below the reading thread, so it gets the CPU while that one waits on the NFC module
+#define PIPELINE_STACK_SIZE 0x4000
+
+struct thenaya_pipeline {
+	const thenaya_keys *keys;
+	Thread worker;
+	int started; //seed bytes seen, keygen running or done
+	u8 head[NFC3D_AMIIBO_SEED_TAG_END]; //the worker's copy, the reader keeps filling its buffer
+	nfc3d_amiibo_session session;
+	u8 plain[NFC3D_AMIIBO_SIZE];
+};
+
+#define UNPACK_PENDING 0
+#define UNPACK_OK 1
+#define UNPACK_FAILED 2
+
+struct thenaya_ctx {
+	LightLock lock; //guards the free list
+	const thenaya_keys *keys;
+	thenaya_amiibo *slots;
+	thenaya_amiibo *freeList;
+	int slotCount;
+	int freeCount;
+};
+
+int thenaya_keysCreate(thenaya_keys **keys, u8 *keybuffer, int size) {
+	*keys = NULL;
+	thenaya_keys *created = malloc(sizeof(thenaya_keys));
+	if (!created)
+		return THENAYA_ERR_OUT_OF_MEMORY;
+
+	if (amitool_prepareKeys(keybuffer, size, &created->prepared) != 0) {
+		thenaya_keysDestroy(created);
+		return THENAYA_ERR_INVALID_KEY;
+	}
+	*keys = created;
+	return THENAYA_ERR_OK;
+}
+
+void thenaya_keysDestroy(thenaya_keys *keys) {
+	if (!keys)
+		return;
+	//drop what was derived from these keys too, the cache is this thread's
+	nfc3d_amiibo_keycache_clear();
+	memset(keys, 0, sizeof(thenaya_keys));
+	free(keys);
+}
+
+int thenaya_ctxCreate(thenaya_ctx **ctx, thenaya_keys *keys, int slots) {
+	*ctx = NULL;
+	if (slots < 1)
+		return THENAYA_ERR_INVALID_SIZE;
+
+	thenaya_ctx *created = malloc(sizeof(thenaya_ctx));
+	if (!created)
+		return THENAYA_ERR_OUT_OF_MEMORY;
+	created->slots = calloc(slots, sizeof(thenaya_amiibo));
+	if (!created->slots) {
+		free(created);
+		return THENAYA_ERR_OUT_OF_MEMORY;
+	}
+
+	LightLock_Init(&created->lock);
+	created->keys = keys;
+	created->slotCount = slots;
+	created->freeCount = slots;
+	created->freeList = NULL;
+	for (int i = slots - 1; i >= 0; i--) {
+		thenaya_amiibo *amiibo = &created->slots[i];
+		LightLock_Init(&amiibo->lock);
+		amiibo->ctx = created;
+		amiibo->nextFree = created->freeList;
+		created->freeList = amiibo;
+	}
+	*ctx = created;
+	return THENAYA_ERR_OK;
+}
+
+//wipes a slot's plaintext and keys, caller holds its lock
+static void clearSlot(thenaya_amiibo *amiibo) {
+	memset(amiibo->tagData, 0, sizeof(amiibo->tagData));
+	memset(amiibo->unpackedData, 0, sizeof(amiibo->unpackedData));
+	nfc3d_amiibo_session_cleanup(&amiibo->session);
+	amiibo->dataLength = 0;
+	amiibo->unpacked = UNPACK_PENDING;
+}
+
+//decrypts and checks the HMACs on first use, the outcome is kept. Caller holds the lock
+static int ensureUnpacked(thenaya_amiibo *amiibo) {
+	if (amiibo->unpacked == UNPACK_PENDING) {
+		int ok = amitool_unpackSessionWith(&amiibo->ctx->keys->prepared, amiibo->tagData, amiibo->dataLength, amiibo->unpackedData, AMIIBO_MAX_SIZE, &amiibo->session);
+		amiibo->unpacked = ok ? UNPACK_OK : UNPACK_FAILED;
+	}
+	return amiibo->unpacked == UNPACK_OK ? THENAYA_ERR_OK : THENAYA_ERR_DECRYPT_FAIL;
+}
+
+void thenaya_ctxDestroy(thenaya_ctx *ctx) {
+	if (!ctx)
+		return;
+	for (int i = 0; i < ctx->slotCount; i++)
+		if (ctx->slots[i].inUse)
+			clearSlot(&ctx->slots[i]);
+	free(ctx->slots);
+	free(ctx);
+}
+
+int thenaya_ctxFreeSlots(thenaya_ctx *ctx) {
+	LightLock_Lock(&ctx->lock);
+	int count = ctx->freeCount;
+	LightLock_Unlock(&ctx->lock);
+	return count;
+}
+
+/*
+loads an amiibo in tag format into a free slot. Only the signature bytes are
+checked here, decryption waits until the plaintext is needed
+*/
+int thenaya_amiiboOpen(thenaya_ctx *ctx, u8 *data, int size, thenaya_amiibo **amiibo) {
+	*amiibo = NULL;
+	if (size < NFC3D_AMIIBO_SIZE || size > AMIIBO_MAX_SIZE)
+		return THENAYA_ERR_INVALID_SIZE;
+	if (!nfc3d_amiibo_has_signature(data))
+		return THENAYA_ERR_VALIDATION_FAILED;
+
+	LightLock_Lock(&ctx->lock);
+	thenaya_amiibo *slot = ctx->freeList;
+	if (slot) {
+		ctx->freeList = slot->nextFree;
+		ctx->freeCount--;
+		slot->inUse = 1;
+	}
+	LightLock_Unlock(&ctx->lock);
+	if (!slot)
+		return THENAYA_ERR_NO_FREE_SLOT;
+
+	//the slot is ours alone until it is handed out, no need to lock it yet
+	memcpy(slot->tagData, data, size);
+	slot->dataLength = size;
+	slot->unpacked = UNPACK_PENDING;
+	*amiibo = slot;
+	return THENAYA_ERR_OK;
+}
+
+void thenaya_amiiboClose(thenaya_amiibo *amiibo) {
+	if (!amiibo)
+		return;
+	thenaya_ctx *ctx = amiibo->ctx;
+
+	LightLock_Lock(&amiibo->lock);
+	clearSlot(amiibo);
+	LightLock_Unlock(&amiibo->lock);
+
+	LightLock_Lock(&ctx->lock);
+	amiibo->inUse = 0;
+	amiibo->nextFree = ctx->freeList;
+	ctx->freeList = amiibo;
+	ctx->freeCount++;
+	LightLock_Unlock(&ctx->lock);
+}
+
+int thenaya_amiiboSetUid(thenaya_amiibo *amiibo, u8 *uid, int uidlen) {
+	//we handle both 7 byte uid and 9 byte uid (7+2 checksums)
+	u8 uid9[NFC3D_AMIIBO_UID9_SIZE];
+	if (uidlen == NFC3D_AMIIBO_UID7_SIZE)
+		nfc3d_amiibo_uid7_to_uid9(uid, uid9);
+	else if (uidlen == NFC3D_AMIIBO_UID9_SIZE)
+		memcpy(uid9, uid, NFC3D_AMIIBO_UID9_SIZE);
+	else
+		return THENAYA_ERR_INVALID_BUFFER_SIZE;
+
+	LightLock_Lock(&amiibo->lock);
+	int res = ensureUnpacked(amiibo);
+	if (res == THENAYA_ERR_OK)
+		nfc3d_amiibo_set_uid(amiibo->unpackedData, uid9);
+	LightLock_Unlock(&amiibo->lock);
+	return res;
+}
+
+/*
+decrypts the amiibo if that has not happened yet and checks both HMACs
+*/
+int thenaya_amiiboVerify(thenaya_amiibo *amiibo) {
+	LightLock_Lock(&amiibo->lock);
+	int res = ensureUnpacked(amiibo);
+	LightLock_Unlock(&amiibo->lock);
+	return res;
+}
+
+/*
+returns amiibo data in tag format
+*/
+int thenaya_amiiboGetTag(thenaya_amiibo *amiibo, u8 *data, int size) {
+	LightLock_Lock(&amiibo->lock);
+	int res = size < amiibo->dataLength ? THENAYA_ERR_BUFFER_TOO_SMALL : ensureUnpacked(amiibo);
+	if (res == THENAYA_ERR_OK) {
+		if (size > amiibo->dataLength)
+			memset(data, 0, size);
+		if (!amitool_packSessionWith(&amiibo->ctx->keys->prepared, amiibo->unpackedData, amiibo->dataLength, data, size, &amiibo->session))
+			res = THENAYA_ERR_ENCRYPT_FAIL;
+	}
+	LightLock_Unlock(&amiibo->lock);
+	return res;
+}
+
+/*
+returns 7 byte uid. The uid and char id are not encrypted, so until the amiibo
+is unpacked they come straight from the tag image
+*/
+int thenaya_amiiboGetUid7(thenaya_amiibo *amiibo, u8 *uid, int uidlen) {
+	if (uidlen < NFC3D_AMIIBO_UID7_SIZE)
+		return THENAYA_ERR_BUFFER_TOO_SMALL;
+	LightLock_Lock(&amiibo->lock);
+	if (amiibo->unpacked == UNPACK_OK)
+		nfc3d_amiibo_uid_to_uid7(nfc3d_amiibo_intl_uid(amiibo->unpackedData), uid);
+	else
+		nfc3d_amiibo_uid_to_uid7(nfc3d_amiibo_tag_uid(amiibo->tagData), uid);
+	LightLock_Unlock(&amiibo->lock);
+	return THENAYA_ERR_OK;
+}
+
+/*
+returns the char id bytes
+*/
+int thenaya_amiiboGetCharIdData(thenaya_amiibo *amiibo, u8 *charData, int charDataLen) {
+	if (charDataLen < NFC3D_AMIIBO_CHAR_ID_SIZE)
+		return THENAYA_ERR_BUFFER_TOO_SMALL;
+	LightLock_Lock(&amiibo->lock);
+	if (amiibo->unpacked == UNPACK_OK)
+		memcpy(charData, nfc3d_amiibo_intl_char_id(amiibo->unpackedData), NFC3D_AMIIBO_CHAR_ID_SIZE);
+	else
+		memcpy(charData, nfc3d_amiibo_tag_char_id(amiibo->tagData), NFC3D_AMIIBO_CHAR_ID_SIZE);
+	LightLock_Unlock(&amiibo->lock);
+	return THENAYA_ERR_OK;
+}
+
+int thenaya_pipelineCreate(thenaya_pipeline **pipeline, thenaya_keys *keys) {
+	*pipeline = calloc(1, sizeof(thenaya_pipeline));
+	if (!*pipeline)
+		return THENAYA_ERR_OUT_OF_MEMORY;
+	(*pipeline)->keys = keys;
+	return THENAYA_ERR_OK;
+}
+
+static void pipelineKeygen(void *arg) {
+	thenaya_pipeline *pipeline = arg;
+	nfc3d_amiibo_session_begin(&pipeline->keys->prepared, pipeline->head, &pipeline->session);
+}
+
+//the key cache is per thread, so wipe the worker's before its stack and TLS go back
+static void pipelineWorker(void *arg) {
+	pipelineKeygen(arg);
+	nfc3d_amiibo_keycache_clear();
+}
+
+static void pipelineJoin(thenaya_pipeline *pipeline) {
+	if (!pipeline->worker)
+		return;
+	threadJoin(pipeline->worker, U64_MAX);
+	threadFree(pipeline->worker);
+	pipeline->worker = NULL;
+}
+
+void thenaya_pipelineDestroy(thenaya_pipeline *pipeline) {
+	if (!pipeline)
+		return;
+	pipelineJoin(pipeline);
+	nfc3d_amiibo_session_cleanup(&pipeline->session);
+	memset(pipeline, 0, sizeof(thenaya_pipeline));
+	free(pipeline);
+}
+
+/*
+starts keygen once the seed bytes are in. Falls back to doing it right here if
+no thread can be made
+*/
+void thenaya_pipelineFeed(thenaya_pipeline *pipeline, u8 *data, int size) {
+	if (pipeline->started || size < NFC3D_AMIIBO_SEED_TAG_END)
+		return;
+	memcpy(pipeline->head, data, sizeof(pipeline->head));
+	pipeline->started = 1;
+
+	s32 prio = 0x30;
+	svcGetThreadPriority(&prio, CUR_THREAD_HANDLE);
+	if (prio < 0x3F)
+		prio++;
+	pipeline->worker = threadCreate(pipelineWorker, pipeline, PIPELINE_STACK_SIZE, prio, -2, false);
+	if (!pipeline->worker)
+		pipelineKeygen(pipeline);
+}
+
+/*
+waits for keygen and checks the tag. The keys are rederived if the seed bytes
+changed after they were fed
+*/
+int thenaya_pipelineFinish(thenaya_pipeline *pipeline, u8 *data, int size) {
+	if (size < NFC3D_AMIIBO_SIZE)
+		return THENAYA_ERR_INVALID_SIZE;
+	thenaya_pipelineFeed(pipeline, data, size);
+	pipelineJoin(pipeline);
+
+	int ok = nfc3d_amiibo_session_finish(&pipeline->keys->prepared, data, pipeline->plain, &pipeline->session);
+	memset(pipeline->plain, 0, sizeof(pipeline->plain));
+	return ok ? THENAYA_ERR_OK : THENAYA_ERR_DECRYPT_FAIL;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <3ds.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//same values as the TAG_ERR_* codes, tag.c passes them straight through, so a new one needs its TAG_ERR_* twin
+#define THENAYA_ERR_OK 0
+#define THENAYA_ERR_INVALID_KEY -1
+#define THENAYA_ERR_DECRYPT_FAIL -2
+#define THENAYA_ERR_INVALID_SIZE -3
+#define THENAYA_ERR_BUFFER_TOO_SMALL -5
+#define THENAYA_ERR_INVALID_BUFFER_SIZE -6
+#define THENAYA_ERR_ENCRYPT_FAIL -7
+#define THENAYA_ERR_VALIDATION_FAILED -8
+#define THENAYA_ERR_NO_FREE_SLOT -10
+#define THENAYA_ERR_OUT_OF_MEMORY -11
+
+/*
+Handles for working with any number of decrypted amiibos at once.
+
+thenaya_keys: checked and prepared master keys. Read only once created, so one
+set can back any number of contexts and threads. Must outlive them.
+thenaya_ctx: a fixed pool of amiibo slots, allocated up front.
+thenaya_amiibo: one decrypted dump, taken from a context's pool.
+thenaya_pipeline: checks a tag while it is being read. Keygen starts on a worker
+thread as soon as the seed pages are in, so only decryption and the HMACs are
+left once the last page arrives.
+
+Opening and closing amiibos is safe from any thread. Each amiibo has its own
+lock, so different amiibos can be worked on in parallel and calls on the same
+one are serialized.
+*/
+typedef struct thenaya_keys thenaya_keys;
+typedef struct thenaya_ctx thenaya_ctx;
+typedef struct thenaya_amiibo thenaya_amiibo;
+typedef struct thenaya_pipeline thenaya_pipeline;
+
+int thenaya_keysCreate(thenaya_keys **keys, u8 *keybuffer, int size);
+void thenaya_keysDestroy(thenaya_keys *keys);
+
+int thenaya_ctxCreate(thenaya_ctx **ctx, thenaya_keys *keys, int slots);
+void thenaya_ctxDestroy(thenaya_ctx *ctx); //closes any amiibos still open
+int thenaya_ctxFreeSlots(thenaya_ctx *ctx);
+
+int thenaya_amiiboOpen(thenaya_ctx *ctx, u8 *data, int size, thenaya_amiibo **amiibo); //data in tag format, decrypted on first need
+void thenaya_amiiboClose(thenaya_amiibo *amiibo);
+int thenaya_amiiboVerify(thenaya_amiibo *amiibo); //decrypts now if not done yet, THENAYA_ERR_DECRYPT_FAIL if the HMACs are wrong
+int thenaya_amiiboSetUid(thenaya_amiibo *amiibo, u8 *uid, int uidlen);
+int thenaya_amiiboGetTag(thenaya_amiibo *amiibo, u8 *data, int size);
+int thenaya_amiiboGetUid7(thenaya_amiibo *amiibo, u8 *uid, int uidlen);
+int thenaya_amiiboGetCharIdData(thenaya_amiibo *amiibo, u8 *charData, int charDataLen);
+
+int thenaya_pipelineCreate(thenaya_pipeline **pipeline, thenaya_keys *keys);
+void thenaya_pipelineDestroy(thenaya_pipeline *pipeline);
+void thenaya_pipelineFeed(thenaya_pipeline *pipeline, u8 *data, int size); //data holds the first size bytes of the tag
+int thenaya_pipelineFinish(thenaya_pipeline *pipeline, u8 *data, int size); //whole tag image, THENAYA_ERR_DECRYPT_FAIL if the HMACs are wrong
+
+#ifdef __cplusplus
+}
+#endif